@@ -1,6 +1,17 @@
 #define _GNU_SOURCE
 
+#include <limits.h>         /* INT_MAX */
+#include <unistd.h>         /* syscall() */
+#include <sys/syscall.h>    /* SYS_futex */
+#include <linux/futex.h>    /* FUTEX_WAIT, FUTEX_WAKE */
+#include <sched.h>          /* sched_yield() */
+#include <errno.h>          /* errno */
+#include <fcntl.h>          /* open() */
+#include <sys/mman.h>       /* mmap(), msync() */
+#include <sys/sendfile.h>   /* sendfile() */
+#include <sys/stat.h>       /* fstat() */
 #include "common.h"
+#include "bashprint.h"
 
 #pragma region SEMAPHORE_MANAGEMENT
 
@@ -42,10 +53,10 @@ int releaseSem(int semId, int semNum)
     return semop(semId, &sops, 1);
 }
 
-/* Init simulation semaphore */
+/* Init simulation semaphore, the master waits at the barrier too */
 int initSemSimulation(int semId, int semNum, int usersNum, int nodesNum)
 {
-    int total = (usersNum + nodesNum);
+    int total = (usersNum + nodesNum + 1);
     struct sembuf sops;
     sops.sem_num = semNum;
     sops.sem_op = total;
@@ -126,60 +137,1137 @@ struct sigaction set_handler(int sig, void (*func)(int))
 
 #pragma endregion /* SIGNALS_MANAGEMENT */
 
+#pragma region FUTEX_MANAGEMENT
+
+/* Sleeps while *addr is equal to val, the futex is shared between processes */
+int futexWait(volatile unsigned int *addr, unsigned int val, 
+              const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+/* Wakes up to count processes sleeping on addr */
+int futexWake(volatile unsigned int *addr, int count)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+#pragma endregion /* FUTEX_MANAGEMENT */
+
+#pragma region SEQLOCK_MANAGEMENT
+
+/* The owner of a slot starts writing it, seq becomes odd */
+void seqWriteBegin(volatile unsigned int *seq)
+{
+    (*seq)++;
+    __sync_synchronize();
+}
+
+/* The owner of a slot ends writing it, seq becomes even */
+void seqWriteEnd(volatile unsigned int *seq)
+{
+    __sync_synchronize();
+    (*seq)++;
+}
+
+/* Copies a slot, trying again if its owner wrote it meanwhile */
+void seqReadCopy(volatile unsigned int *seq, void *dst, const void *src, 
+                 size_t size)
+{
+    unsigned int start;
+
+    do {
+        while((start = *seq) & 1)
+            sched_yield();
+        __sync_synchronize();
+        memcpy(dst, src, size);
+        __sync_synchronize();
+    } while(*seq != start);
+}
+
+#pragma endregion /* SEQLOCK_MANAGEMENT */
+
 #pragma region SHARED_MEM_MANAGEMENT
 
-/*** Inizio Writers Readers Problem Solution
- *  write 0
- *  mutex 1
- *  readerscount 2
+/*** Readers Writers Problem Solution
+ *  state    readers count, -1 when a writer holds the lock
+ *  readers_waiting, writers_waiting  processes sleeping on the futexes
+ *  readers_futex, writers_futex      changed to wake up the sleepers
+ *
+ *  Readers and writers take the lock with a compare-and-swap on state,
+ *  so no syscalls are made when the lock is free. A process that finds
+ *  the lock busy registers itself as waiting, then sleeps on its futex
+ *  word only if the lock is still busy: the releaser changes state first
+ *  and then checks the waiting counters, so a wake up can't be lost.
+ *  A release wakes all the readers but only one writer.
  *  ***/
 
+/* Initializes the lock to free */
+void initRWLock(shm_rwlock *lock)
+{
+    memset(lock, 0, sizeof(shm_rwlock));
+}
+
+/* Sleeps until the lock is released, if the process still can't take it */
+void waitRWLock(shm_rwlock *lock, int writer)
+{
+    unsigned int val;
+
+    if(writer){
+        __sync_fetch_and_add(&lock->writers_waiting, 1);
+        val = lock->writers_futex;
+        if(lock->state != 0)
+            futexWait(&lock->writers_futex, val, NULL);
+        __sync_fetch_and_sub(&lock->writers_waiting, 1);
+    } else {
+        __sync_fetch_and_add(&lock->readers_waiting, 1);
+        val = lock->readers_futex;
+        if(lock->state < 0)
+            futexWait(&lock->readers_futex, val, NULL);
+        __sync_fetch_and_sub(&lock->readers_waiting, 1);
+    }
+}
+
+/* Wakes the sleeping processes after a release */
+void wakeRWLock(shm_rwlock *lock, int readers)
+{
+    if(readers && lock->readers_waiting > 0){
+        __sync_fetch_and_add(&lock->readers_futex, 1);
+        futexWake(&lock->readers_futex, INT_MAX);
+    }
+    if(lock->writers_waiting > 0){
+        __sync_fetch_and_add(&lock->writers_futex, 1);
+        futexWake(&lock->writers_futex, 1);
+    }
+}
+
 /** Lettura 
- *  Write e mutex inizializzati ad 1 e rc a 0. Mutex ci assicura l'esclusione mutuale 
- * 	e write si occupa delle scritture ed è utilizzato sia da reader che da writer. 
- * 	Readerscount descrive il numero di processi readers che hanno accesso alla risorsa.
- *  Quando rc è uguale a 1 i writer aspettano. Con questo ci assicuriamo che i writer 
- * 	non possono accedere alla risorsa finché un reader sta leggendo la stessa.
- *  Quando il reader ha finito rc viene decrementato, quando è uguale a 0 un writer
- *  può accederci.
+ *  Many readers can hold the lock together, the readers count is
+ *  incremented only if no writer has the lock.
  * **/
-void initReadFromShm(int semId)
+void initReadFromShm(shm_rwlock *lock)
 {
-    reserveSem(semId, 1);
-    releaseSem(semId, 2);
-    if (semctl(semId, 2, GETVAL, 0) == 1)
-        reserveSem(semId, 0);
-    releaseSem(semId, 1);
+    int state;
+
+    while(1){
+        state = lock->state;
+        if(state >= 0 
+           && __sync_bool_compare_and_swap(&lock->state, state, state + 1))
+            return;
+        if(state < 0)
+            waitRWLock(lock, 0);
+    }
 }
 
-void endReadFromShm(int semId)
+void endReadFromShm(shm_rwlock *lock)
 {
-    reserveSem(semId, 1);
-    reserveSem(semId, 2);
-    if (semctl(semId, 2, GETVAL, 0) == 0)
-        releaseSem(semId, 0);
-    releaseSem(semId, 1);
+    /* The last reader wakes a writer */
+    if(__sync_sub_and_fetch(&lock->state, 1) == 0)
+        wakeRWLock(lock, 0);
 }
 
 /** Scrittura
- * Se un writer vuole accedere l'oggetto aspetterà il semaforo write uguale a 0. 
- * Come inizia la sua scrittura si riserva il semaforo e nessun altro writer 
- * può accederci.
+ *  A writer takes the lock only when there are no readers and writers.
  * **/
-void initWriteInShm(int semId)
+void initWriteInShm(shm_rwlock *lock)
 {
-    reserveSem(semId, 0);
+    while(!__sync_bool_compare_and_swap(&lock->state, 0, -1))
+        waitRWLock(lock, 1);
 }
 
-void endWriteInShm(int semId)
+void endWriteInShm(shm_rwlock *lock)
 {
-    releaseSem(semId, 0);
+    __sync_fetch_and_add(&lock->state, 1);
+    wakeRWLock(lock, 1);
 }
 
 #pragma endregion /* SHARED_MEM_MANAGEMENT */
 
+#pragma region ARENA_MANAGEMENT
+
+/* Rounds size up to a cache line */
+size_t arenaAlign(size_t size)
+{
+    return (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+/* 
+ * Writes in the header the offsets of the regions for the given 
+ * configuration, returns the size of the arena
+ */
+size_t arenaLayout(arena_header *arena, unsigned long *conf)
+{
+    size_t size[N_ARENA_REGIONS];
+    int i = 0;
+
+    size[REGION_CONF] = sizeof(unsigned long) * N_RUNTIME_CONF_VALUES;
+    size[REGION_USERS] = sizeof(user) * conf[SO_USERS_NUM];
+    size[REGION_NODES] = sizeof(node) * conf[SO_MAX_NODES];
+    size[REGION_BALANCES] = sizeof(account) * conf[SO_USERS_NUM];
+    size[REGION_LOCKS] = sizeof(shm_rwlock) * N_SHM_LOCKS;
+    size[REGION_POOLS] = tpSize(conf[SO_TP_SIZE]) * (conf[SO_MAX_NODES] + 1);
+    size[REGION_NODES_NUM] = sizeof(int);
+
+    arena->magic = ARENA_MAGIC;
+    arena->version = ARENA_VERSION;
+    arena->huge_pages = 0;
+    arena->offset[0] = arenaAlign(sizeof(arena_header));
+    for(i = 0; i < N_ARENA_REGIONS; i++)
+        arena->offset[i + 1] = arena->offset[i] + arenaAlign(size[i]);
+    arena->size = arena->offset[N_ARENA_REGIONS];
+
+    return arena->size;
+}
+
+/* Returns the start of a region of the arena */
+void *arenaRegion(arena_header *arena, int region)
+{
+    return (char *)arena + arena->offset[region];
+}
+
+/* Returns -1 if the arena was not made by this version of the master */
+int arenaCheck(arena_header *arena)
+{
+    if(arena->magic != ARENA_MAGIC || arena->version != ARENA_VERSION)
+        return -1;
+    return 0;
+}
+
+/* 
+ * Reads a byte of every page of a region, so the process maps them now 
+ * and not while the simulation is running
+ */
+void arenaPrefault(arena_header *arena, int region)
+{
+    volatile char *start = arenaRegion(arena, region);
+    size_t size = arena->offset[region + 1] - arena->offset[region];
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t i = 0;
+    char c;
+
+    for(i = 0; i < size; i += page)
+        c = start[i];
+    (void)c;
+}
+
+#pragma endregion /* ARENA_MANAGEMENT */
+
+#pragma region LEDGER_MANAGEMENT
+
+/* Bytes of the Libro Mastro file */
+size_t ledgerSize()
+{
+    return arenaAlign(sizeof(ledger_header)) 
+           + sizeof(block) * SO_REGISTRY_SIZE;
+}
+
+/* 
+ * Maps the Libro Mastro file. With create the file is made empty, with
+ * no blocks, otherwise its header must match this build. Returns NULL 
+ * with errno set on error.
+ */
+ledger_header *ledgerMap(const char *path, int create)
+{
+    ledger_header *ledger;
+    int fd = -1;
+
+    if(create)
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    else
+        fd = open(path, O_RDWR);
+    if(fd == -1)
+        return NULL;
+    if(create && ftruncate(fd, ledgerSize()) == -1){
+        close(fd);
+        return NULL;
+    }
+    ledger = mmap(NULL, ledgerSize(), PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+    /* The mapping stays after close() */
+    close(fd);
+    if(ledger == MAP_FAILED)
+        return NULL;
+
+    if(create){
+        ledger->magic = LEDGER_MAGIC;
+        ledger->version = LEDGER_VERSION;
+        ledger->block_size = SO_BLOCK_SIZE;
+        ledger->registry_size = SO_REGISTRY_SIZE;
+        ledger->block_bytes = sizeof(block);
+        ledger->layout = LEDGER_LAYOUT;
+        ledger->blocks_offset = arenaAlign(sizeof(ledger_header));
+    } else if(ledger->magic != LEDGER_MAGIC 
+              || ledger->version != LEDGER_VERSION
+              || ledger->block_size != SO_BLOCK_SIZE
+              || ledger->registry_size != SO_REGISTRY_SIZE
+              || ledger->block_bytes != sizeof(block)
+              || ledger->layout != LEDGER_LAYOUT){
+        munmap(ledger, ledgerSize());
+        errno = EINVAL;
+        return NULL;
+    }
+    return ledger;
+}
+
+/* Waits until the Libro Mastro is written to disk */
+void ledgerSync(ledger_header *ledger)
+{
+    msync(ledger, ledgerSize(), MS_SYNC);
+}
+
+/* Unmaps the Libro Mastro, the file stays */
+void ledgerUnmap(ledger_header *ledger)
+{
+    munmap(ledger, ledgerSize());
+}
+
+/* Returns the first block of the Libro Mastro */
+block *ledgerBlocks(ledger_header *ledger)
+{
+    return (block *)((char *)ledger + ledger->blocks_offset);
+}
+
+/* 
+ * FNV-1a of the block number and of the transactions, read one at a time
+ * so that both the layouts give the same hash
+ */
+unsigned int ledgerBlockChecksum(block *b)
+{
+    transaction trans;
+    unsigned char *p = (unsigned char *)&trans;
+    unsigned int hash = 2166136261U ^ b->block_number;
+    size_t i = 0;
+    int j = 0;
+
+    hash *= 16777619U;
+    for(j = 0; j < SO_BLOCK_SIZE; j++){
+        blockRead(b, j, &trans);
+        for(i = 0; i < sizeof(trans); i++){
+            hash ^= p[i];
+            hash *= 16777619U;
+        }
+    }
+    return hash;
+}
+
+/* Copies the transaction i of the block in trans */
+void blockRead(block *b, int i, transaction *trans)
+{
+    trans->timestamp = BLOCK_TIMESTAMP(b, i);
+    trans->sender = BLOCK_SENDER(b, i);
+    trans->receiver = BLOCK_RECEIVER(b, i);
+    trans->quantity = BLOCK_QUANTITY(b, i);
+    trans->reward = BLOCK_REWARD(b, i);
+}
+
+/* 
+ * Writes the SO_BLOCK_SIZE transactions of trans and the number in the 
+ * block, not published yet
+ */
+void blockWrite(block *b, unsigned int number, transaction *trans)
+{
+    int i = 0;
+
+    b->block_number = number;
+    b->published = 0;
+    for(i = 0; i < SO_BLOCK_SIZE; i++){
+        BLOCK_TIMESTAMP(b, i) = trans[i].timestamp;
+        BLOCK_SENDER(b, i) = trans[i].sender;
+        BLOCK_RECEIVER(b, i) = trans[i].receiver;
+        BLOCK_QUANTITY(b, i) = trans[i].quantity;
+        BLOCK_REWARD(b, i) = trans[i].reward;
+    }
+}
+
+/* 
+ * Adds the transactions of a committed block to the users' balances,
+ * userIndex gives the index of a user id, -1 if the id is not a user
+ */
+void ledgerApplyBalances(block *b, account *balances, int (*userIndex)(int))
+{
+    int i = 0;
+    int index = 0;
+
+    for(i = 0; i < SO_BLOCK_SIZE; i++){
+        index = userIndex(BLOCK_RECEIVER(b, i));
+        if(index != -1)
+            __sync_fetch_and_add(&balances[index].credits,
+                                 BLOCK_QUANTITY(b, i));
+
+        /* The reward transaction has no sender account */
+        if(BLOCK_SENDER(b, i) == TRANS_REWARD_SENDER)
+            continue;
+        index = userIndex(BLOCK_SENDER(b, i));
+        if(index != -1)
+            __sync_fetch_and_add(&balances[index].debits,
+                                 BLOCK_QUANTITY(b, i) + BLOCK_REWARD(b, i));
+    }
+}
+
+/* 
+ * Moves the published block number forward over the consecutive blocks
+ * already written, the readers never go past an unpublished slot.
+ * Returns 1 to the caller that published the last block.
+ */
+int ledgerPublish(ledger_header *ledger)
+{
+    volatile block *blocks = ledgerBlocks(ledger);
+    unsigned int *published = &ledger->block_number[BLOCK_PUBLISHED];
+    unsigned int n = *(volatile unsigned int *)published;
+    int full = 0;
+
+    while(n < SO_REGISTRY_SIZE && blocks[n].published){
+        if(__sync_bool_compare_and_swap(published, n, n + 1)
+           && n + 1 == SO_REGISTRY_SIZE)
+            full = 1;
+        n = *(volatile unsigned int *)published;
+    }
+    return full;
+}
+
+/* 
+ * Writes trans in the next free block of the Libro Mastro, adds it to
+ * the checksum and to the balances and publishes it. The reward
+ * transaction is added to *reward only here, once the block is
+ * committed. Returns NULL when the Libro Mastro is full, nothing is
+ * written. *last is 1 for the caller that published the last block.
+ */
+block *ledgerCommit(ledger_header *ledger, transaction *trans,
+                    account *balances, int (*userIndex)(int),
+                    int *reward, int *last)
+{
+    unsigned int number = 0;
+    block *b;
+
+    /* Reserving a slot of the libro mastro's array of blocks */
+    number = __sync_fetch_and_add(&ledger->block_number[BLOCK_RESERVED], 1);
+    if(number >= SO_REGISTRY_SIZE)
+        return NULL;
+
+    b = &ledgerBlocks(ledger)[number];
+    blockWrite(b, number, trans);
+    __sync_fetch_and_xor(&ledger->checksum, ledgerBlockChecksum(b));
+    ledgerApplyBalances(b, balances, userIndex);
+    *reward += trans[SO_BLOCK_SIZE - 1].quantity;
+
+    /* The block is complete before it is marked as readable */
+    __sync_synchronize();
+    b->published = 1;
+    __sync_synchronize();
+    *last = ledgerPublish(ledger);
+    return b;
+}
+
+#pragma endregion /* LEDGER_MANAGEMENT */
+
+#pragma region EXPORT_MANAGEMENT
+
+/* 
+ * Creates the file of the exported blocks in part_path, the export goes
+ * in path at the end. Returns -1 with errno set.
+ */
+int exportOpen(block_export *ex, const char *path, const char *part_path)
+{
+    ex->path = path;
+    ex->part_path = part_path;
+    ex->blocks = 0;
+    ex->buffer = NULL;
+    ex->fp = fopen(part_path, "w+");
+    if(ex->fp == NULL)
+        return -1;
+    /* Few large writes, the buffer is flushed only when full */
+    ex->buffer = malloc(EXPORT_BUFFER_SIZE);
+    if(ex->buffer != NULL)
+        setvbuf(ex->fp, ex->buffer, _IOFBF, EXPORT_BUFFER_SIZE);
+    return 0;
+}
+
+/* Appends the blocks published after the last call */
+void exportBlocks(block_export *ex, block *blocks, unsigned int published)
+{
+    block *b;
+    int j = 0;
+
+    for(; ex->blocks < published; ex->blocks++){
+        b = &blocks[ex->blocks];
+        fprintf(ex->fp, "Block #%d:\n", ex->blocks);
+        for(j = 0; j < SO_BLOCK_SIZE; j++){
+            fprintf(ex->fp, "\tTransaction #%d: t=%d.%d\t snd=%d\t rcv=%d\t qty=%d\t rwd=%d\n",
+                    j, (int)BLOCK_TIMESTAMP(b, j).tv_sec,
+                    (int)BLOCK_TIMESTAMP(b, j).tv_nsec, BLOCK_SENDER(b, j),
+                    BLOCK_RECEIVER(b, j), BLOCK_QUANTITY(b, j),
+                    BLOCK_REWARD(b, j));
+        }
+    }
+}
+
+/* 
+ * Exports the last blocks, writes the header in the export's path and 
+ * the kernel copies the blocks after it. Returns -1 with errno set, the
+ * blocks are left in part_path.
+ */
+int exportClose(block_export *ex, block *blocks, unsigned int published)
+{
+    FILE *fp;
+    struct stat st;
+    off_t offset = 0;
+    ssize_t n = 1;
+    int err = 0;
+
+    exportBlocks(ex, blocks, published);
+    if(fflush(ex->fp) == EOF || fstat(fileno(ex->fp), &st) == -1){
+        err = errno;
+        fclose(ex->fp);
+        free(ex->buffer);
+        ex->fp = NULL;
+        ex->buffer = NULL;
+        errno = err;
+        return -1;
+    }
+
+    fp = fopen(ex->path, "w");
+    if(fp != NULL){
+        fprintf(fp, "\n\n===============BLOCKCHAIN==============\n");
+        fprintf(fp, "# of blocks: %d\n", published);
+        fflush(fp);
+        while(offset < st.st_size && n > 0)
+            n = sendfile(fileno(fp), fileno(ex->fp), &offset, 
+                         st.st_size - offset);
+        if(n == -1)
+            err = errno;
+        fclose(fp);
+    } else {
+        err = errno;
+    }
+
+    fclose(ex->fp);
+    free(ex->buffer);
+    ex->fp = NULL;
+    ex->buffer = NULL;
+    if(err == 0)
+        unlink(ex->part_path);
+    errno = err;
+    return err != 0 ? -1 : 0;
+}
+
+#pragma endregion /* EXPORT_MANAGEMENT */
+
+#pragma region TRANSACTION_POOL_MANAGEMENT
+
+/*** Transaction Pool
+ *  Every slot has a sequence number: a slot at position pos of the ring
+ *  is free when seq == pos and it holds a transaction when seq == pos+1.
+ *  A user reserves the tail position with a compare-and-swap, copies the
+ *  transaction and then publishes it by setting seq. The node reads the
+ *  slot at head and gives it back for the next lap (seq = pos+capacity).
+ *  When the pool is empty the node sleeps on futex, the users wake it
+ *  only if it's sleeping.
+ *  ***/
+
+/* Bytes used by a pool with its slots, every pool starts at a cache line */
+size_t tpSize(unsigned long capacity)
+{
+    size_t size = sizeof(tpool) + capacity * sizeof(tp_slot);
+
+    return (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+/* Returns the pool at index in the pools segment */
+tpool *tpGet(void *pools, int index, unsigned long capacity)
+{
+    return (tpool *)((char *)pools + tpSize(capacity) * index);
+}
+
+/* Returns the slots of a pool */
+tp_slot *tpSlots(tpool *pool)
+{
+    return (tp_slot *)((char *)pool + sizeof(tpool));
+}
+
+/* Initializes an empty pool */
+void tpInit(tpool *pool, unsigned long capacity)
+{
+    tp_slot *slots = tpSlots(pool);
+    unsigned long i = 0;
+
+    pool->tail = 0;
+    pool->head = 0;
+    pool->sleeping = 0;
+    pool->futex = 0;
+    pool->capacity = capacity;
+    for(i = 0; i < capacity; i++)
+        slots[i].seq = i;
+}
+
+/* 
+ * Adds count transactions to the pool with a single reservation of
+ * consecutive slots, returns -1 if the pool has not enough free slots.
+ * The node frees the slots in order: if the last one is free, all of 
+ * them are free. hops are the times every transaction was forwarded,
+ * NULL for new transactions.
+ */
+int tpPush(tpool *pool, transaction *trans, int count, int *hops)
+{
+    tp_slot *slot;
+    unsigned long pos = pool->tail;
+    long dif;
+    int i = 0;
+
+    while(1){
+        slot = &tpSlots(pool)[(pos + count - 1) % pool->capacity];
+        dif = (long)(slot->seq - (pos + count - 1));
+        if(dif == 0){
+            if(__sync_bool_compare_and_swap(&pool->tail, pos, pos + count))
+                break;
+        } else if(dif < 0){
+            /* The node didn't read this slot yet */
+            return -1;
+        }
+        pos = pool->tail;
+    }
+
+    for(i = 0; i < count; i++){
+        slot = &tpSlots(pool)[(pos + i) % pool->capacity];
+        slot->trans = trans[i];
+        slot->hops = hops != NULL ? hops[i] : 0;
+        __sync_synchronize();
+        slot->seq = pos + i + 1;
+    }
+    __sync_synchronize();
+
+    if(pool->sleeping){
+        __sync_fetch_and_add(&pool->futex, 1);
+        futexWake(&pool->futex, 1);
+    }
+    return 0;
+}
+
+/* 
+ * Copies up to max of the oldest transactions in trans (and the times
+ * they were forwarded in hops, if not NULL) leaving them in the pool,
+ * returns how many were copied (0 if the pool is empty) 
+ */
+int tpPeek(tpool *pool, transaction *trans, int *hops, int max)
+{
+    unsigned long pos = pool->head;
+    tp_slot *slot;
+    int n = 0;
+
+    while(n < max){
+        slot = &tpSlots(pool)[pos % pool->capacity];
+        if(slot->seq != pos + 1)
+            break;
+
+        __sync_synchronize();
+        trans[n] = slot->trans;
+        if(hops != NULL)
+            hops[n] = slot->hops;
+        pos++;
+        n++;
+    }
+    return n;
+}
+
+/* Gives back to the users the count oldest slots, already copied */
+void tpDrop(tpool *pool, int count)
+{
+    unsigned long pos = pool->head;
+    int i = 0;
+
+    __sync_synchronize();
+    for(i = 0; i < count; i++)
+        tpSlots(pool)[(pos + i) % pool->capacity].seq 
+            = pos + i + pool->capacity;
+    pool->head = pos + count;
+}
+
+/* 
+ * Takes up to max of the oldest transactions in one pass and copies them
+ * in trans, returns how many were read (0 if the pool is empty) 
+ */
+int tpPopBatch(tpool *pool, transaction *trans, int max)
+{
+    int n = tpPeek(pool, trans, NULL, max);
+
+    tpDrop(pool, n);
+    return n;
+}
+
+/* 
+ * The owner sleeps until a transaction is published in its pool, for 
+ * at most timeout (NULL to wait with no limit)
+ */
+void tpWait(tpool *pool, const struct timespec *timeout)
+{
+    unsigned int val = pool->futex;
+    tp_slot *slot;
+
+    pool->sleeping = 1;
+    __sync_synchronize();
+    slot = &tpSlots(pool)[pool->head % pool->capacity];
+    if(slot->seq != pool->head + 1)
+        futexWait(&pool->futex, val, timeout);
+    pool->sleeping = 0;
+}
+
+/* Number of transactions in the pool */
+unsigned long tpCount(tpool *pool)
+{
+    unsigned long head = pool->head;
+    unsigned long tail = pool->tail;
+
+    return tail > head ? tail - head : 0;
+}
+
+#pragma endregion /* TRANSACTION_POOL_MANAGEMENT */
+
+#pragma region CONFIGURATION
+
+/* only used by readConfiguration() as env. variable names */
+const char conf_names[N_RUNTIME_CONF_VALUES][22+1] = {
+	"SO_USERS_NUM", "SO_NODES_NUM", "SO_BUDGET_INIT", "SO_REWARD",
+	"SO_MIN_TRANS_GEN_NSEC", "SO_MAX_TRANS_GEN_NSEC", "SO_RETRY",
+	"SO_TP_SIZE", "SO_MIN_TRANS_PROC_NSEC", "SO_MAX_TRANS_PROC_NSEC", 
+	"SO_SIM_SEC", "SO_FRIENDS_NUM", "SO_HOPS", 
+	"SO_TRANS_BURST", "SO_PRIORITY", "SO_MAX_NODES", "SO_HUGE_PAGES", 
+	"SO_PREFAULT", "SO_PLACEMENT", "SO_VIRTUAL_TIME", "SO_SEED"
+};
+
+/* Used when an optional env. variable is not defined */
+const unsigned long conf_defaults[N_RUNTIME_CONF_VALUES 
+                                  - N_REQUIRED_CONF_VALUES] = {
+	1, /* SO_TRANS_BURST */
+	0, /* SO_PRIORITY */
+	0, /* SO_MAX_NODES, 0 for no nodes spawned at runtime */
+	0, /* SO_HUGE_PAGES */
+	0, /* SO_PREFAULT */
+	0, /* SO_PLACEMENT */
+	0, /* SO_VIRTUAL_TIME, only used by bin/sim */
+	0  /* SO_SEED, 0 for a seed from the time */
+};
+
+/* 
+ * Reads the configuration from the environment variables and checks it,
+ * returns -1 with a message when a value is missing or not valid 
+ */
+int readConfiguration(unsigned long *conf)
+{
+    /* used to read env variables */
+	char *env_var_val = NULL;
+    /* used to detect errors when converting str to ulong */
+	char *chk_strtol_err = NULL;
+	char i = 0;
+
+	for (i = SO_USERS_NUM; i < N_RUNTIME_CONF_VALUES; i++) {
+		if(env_var_val = getenv(conf_names[i])){
+			errno = 0;
+			conf[i] = strtoul(env_var_val, &chk_strtol_err, 10);
+			/* check conversion */
+			if((conf[i] == 0 && (errno == EINVAL || errno == ERANGE)) 
+                || env_var_val == chk_strtol_err) {
+				fprintf(stderr, "[%sERROR%s] Could not convert env variable %s to an unsigned long\n",
+						COLOR_RED, COLOR_FLUSH, conf_names[i]);
+				return -1;
+			}
+			/* check valid number */
+			if(i == SO_MAX_TRANS_GEN_NSEC && conf[SO_MAX_TRANS_GEN_NSEC] 
+                < conf[SO_MIN_TRANS_GEN_NSEC]) {
+				MSG_ERR("SO_MAX_TRANS_GEN_NSEC is lower than SO_MIN_TRANS_GEN_NSEC!");
+				return -1;
+			} else if(i == SO_MAX_TRANS_PROC_NSEC 
+                        && conf[SO_MAX_TRANS_PROC_NSEC] 
+                        < conf[SO_MIN_TRANS_PROC_NSEC]) {
+				MSG_ERR("SO_MAX_TRANS_PROC_NSEC is lower than SO_MIN_TRANS_PROC_NSEC!");
+				return -1;
+			} else if(i == SO_TP_SIZE && conf[SO_TP_SIZE] <= SO_BLOCK_SIZE) {
+				MSG_ERR("SO_TP_SIZE is not bigger than SO_BLOCK_SIZE!");
+				return -1;
+			} else if(i == SO_REWARD && (conf[SO_REWARD] < 0 
+                        || conf[SO_REWARD] > 100)) {
+				MSG_ERR("SO_REWARD is out range [0-100]!");
+				return -1;
+			} else if(i == SO_TRANS_BURST && (conf[SO_TRANS_BURST] < 1 
+                        || conf[SO_TRANS_BURST] > conf[SO_TP_SIZE])) {
+				MSG_ERR("SO_TRANS_BURST is out range [1-SO_TP_SIZE]!");
+				return -1;
+			} else if(i == SO_PRIORITY && conf[SO_PRIORITY] > 1) {
+				MSG_ERR("SO_PRIORITY is out range [0-1]!");
+				return -1;
+			} else if(i == SO_HUGE_PAGES && conf[SO_HUGE_PAGES] > 1) {
+				MSG_ERR("SO_HUGE_PAGES is out range [0-1]!");
+				return -1;
+			} else if(i == SO_PREFAULT && conf[SO_PREFAULT] > 1) {
+				MSG_ERR("SO_PREFAULT is out range [0-1]!");
+				return -1;
+			} else if(i == SO_PLACEMENT && conf[SO_PLACEMENT] > 1) {
+				MSG_ERR("SO_PLACEMENT is out range [0-1]!");
+				return -1;
+			} else if(i == SO_VIRTUAL_TIME && conf[SO_VIRTUAL_TIME] > 1) {
+				MSG_ERR("SO_VIRTUAL_TIME is out range [0-1]!");
+				return -1;
+			} else if(i == SO_MAX_NODES && conf[SO_MAX_NODES] != 0
+                        && conf[SO_MAX_NODES] < conf[SO_NODES_NUM]) {
+				MSG_ERR("SO_MAX_NODES is lower than SO_NODES_NUM!");
+				return -1;
+			}
+		} else if(i >= N_REQUIRED_CONF_VALUES) {
+			conf[i] = conf_defaults[i - N_REQUIRED_CONF_VALUES];
+		} else {
+			fprintf(stderr, 
+                    "[%sERROR%s] Undefined environment variable %s. Make sure to load env. variables first!\n"
+                    "        Example: source cfg/custom.cfg\n",
+                    COLOR_RED, COLOR_FLUSH, conf_names[i]);
+			return -1;
+		}
+	}
+	/* Without SO_MAX_NODES the number of nodes does not change */
+	if(conf[SO_MAX_NODES] < conf[SO_NODES_NUM])
+		conf[SO_MAX_NODES] = conf[SO_NODES_NUM];
+	/* The seed used is printed in the stats to replay the run */
+	if(conf[SO_SEED] == 0)
+		conf[SO_SEED] = ((unsigned long)time(NULL) << 16) ^ getpid();
+	return 0;
+}
+
+#pragma endregion /* CONFIGURATION */
+
+#pragma region RANDOM_NUMBERS
+
+/* Stream of the process used by randomNum() */
+rng_state proc_rng;
+
+/* 
+ * The four words of the state are drawn from seed and stream by a 
+ * splitmix32 sequence, different streams give unrelated states
+ */
+void rngSeed(rng_state *rng, unsigned long seed, unsigned int stream)
+{
+	unsigned int x;
+	unsigned int z;
+	int i = 0;
+
+	x = (unsigned int)(seed & 0xffffffffUL) 
+	    ^ (unsigned int)((seed >> 16) >> 16) * 0x85ebca6bU
+	    ^ stream * 0xc2b2ae35U;
+	for(i = 0; i < 4; i++){
+		z = (x += 0x9e3779b9U);
+		z = (z ^ (z >> 16)) * 0x21f0aaadU;
+		z = (z ^ (z >> 15)) * 0x735a2d97U;
+		rng->s[i] = z ^ (z >> 15);
+	}
+	/* The all zero state never changes */
+	if((rng->s[0] | rng->s[1] | rng->s[2] | rng->s[3]) == 0)
+		rng->s[0] = 1;
+}
+
+/* Next 32 bit number of the xoshiro128** stream */
+unsigned int rngNext(rng_state *rng)
+{
+	unsigned int *s = rng->s;
+	unsigned int x = s[1] * 5;
+	unsigned int result = ((x << 7) | (x >> 25)) * 9;
+	unsigned int t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 11) | (s[3] >> 21);
+
+	return result;
+}
+
+/* Random number in [min, max] from the stream, like rand() it uses 31 bits */
+int rngRange(rng_state *rng, int min, int max)
+{
+	return min + (rngNext(rng) >> 1) 
+	             / (0x7fffffffU / (unsigned int)(max - min + 1) + 1);
+}
+
+/* Seeds the stream of the process */
+void initRandom(unsigned long seed, unsigned int stream)
+{
+	rngSeed(&proc_rng, seed, stream);
+}
+
 /* Useful random number function */
 int randomNum(int min, int max)
 {
-    return min + rand() / (RAND_MAX / (max - min + 1) + 1);
+	return rngRange(&proc_rng, min, max);
+}
+
+#pragma endregion /* RANDOM_NUMBERS */
+
+#pragma region STATISTICS
+
+/* Rewards are grouped by powers of two: 1, 2-3, 4-7, ... */
+int rewardBucket(int reward)
+{
+    int bucket = 0;
+
+    while(reward > 1 && bucket < N_REWARD_BUCKETS - 1){
+        reward >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/* 
+ * Adds the time between the creation and now of the block's transactions
+ * to the latencies of their reward, the reward transaction is skipped
+ */
+void blockLatencies(block *b, struct timespec *now, unsigned int *count,
+                    unsigned long *sum_usec, unsigned long *max_usec)
+{
+    unsigned long usec;
+    int bucket = 0;
+    int i = 0;
+
+    for(i = 0; i < SO_BLOCK_SIZE - 1; i++){
+        usec = (now->tv_sec - BLOCK_TIMESTAMP(b, i).tv_sec) * 1000000L
+               + (now->tv_nsec - BLOCK_TIMESTAMP(b, i).tv_nsec) / 1000;
+        bucket = rewardBucket(BLOCK_REWARD(b, i));
+        count[bucket]++;
+        sum_usec[bucket] += usec;
+        if(usec > max_usec[bucket])
+            max_usec[bucket] = usec;
+    }
 }
+
+/* Returns the budget of a user committed in the Libro Mastro */
+int committedBudget(account *balances, int index, unsigned long *conf)
+{
+    return conf[SO_BUDGET_INIT] + balances[index].credits
+           - balances[index].debits;
+}
+
+/* Prints how many blocks per second were written between begin and end */
+void printBlockRate(unsigned int blocks, struct timespec *begin,
+                    struct timespec *end)
+{
+    double elapsed = 0;
+
+    elapsed = (end->tv_sec - begin->tv_sec)
+              + (end->tv_nsec - begin->tv_nsec) / 1e9;
+    if(elapsed > 0)
+        printf("Blocks per second: %.2f\n", blocks / elapsed);
+}
+
+/* Prints how many transactions the nodes read from the pool per wakeup */
+void printBatchFill(node *nodes, int nodes_num)
+{
+    int i = 0;
+    node n;
+    unsigned long batches = 0;
+    unsigned long batch_trans = 0;
+
+    for(i = 0; i < nodes_num; i++){
+        seqReadCopy(&nodes[i].seq, &n, &nodes[i], sizeof(n));
+        batches += n.batches;
+        batch_trans += n.batch_trans;
+    }
+    if(batches > 0)
+        printf("Average batch fill: %.2f/%d transactions\n",
+               batch_trans / (double)batches, SO_BLOCK_SIZE - 1);
+}
+
+/* Prints how many pushes found a full pool */
+void printPushStats(user *users, unsigned long *conf)
+{
+    int i = 0;
+    user u;
+    unsigned long redirects = 0;
+    unsigned long rejects = 0;
+
+    for(i = 0; i < conf[SO_USERS_NUM]; i++){
+        seqReadCopy(&users[i].seq, &u, &users[i], sizeof(u));
+        redirects += u.redirects;
+        rejects += u.rejects;
+    }
+    printf("Full pools: %lu redirects to another node, %lu rejects\n",
+           redirects, rejects);
+}
+
+/* 
+ * Prints the commit latency of the transactions grouped by reward, 
+ * priority is 1 if the nodes filled the blocks by reward
+ */
+void printCommitLatency(node *nodes, int nodes_num, int priority)
+{
+    int i = 0, j = 0;
+    node n;
+    unsigned long count[N_REWARD_BUCKETS];
+    unsigned long sum[N_REWARD_BUCKETS];
+    unsigned long max[N_REWARD_BUCKETS];
+
+    for(j = 0; j < N_REWARD_BUCKETS; j++){
+        count[j] = 0;
+        sum[j] = 0;
+        max[j] = 0;
+    }
+    for(i = 0; i < nodes_num; i++){
+        seqReadCopy(&nodes[i].seq, &n, &nodes[i], sizeof(n));
+        for(j = 0; j < N_REWARD_BUCKETS; j++){
+            count[j] += n.lat_count[j];
+            sum[j] += n.lat_sum_usec[j];
+            if(n.lat_max_usec[j] > max[j])
+                max[j] = n.lat_max_usec[j];
+        }
+    }
+
+    printf("Commit latency by reward (%s):\n", 
+           priority ? "priority" : "fifo");
+    for(j = 0; j < N_REWARD_BUCKETS; j++){
+        if(count[j] == 0)
+            continue;
+        if(j == 0)
+            printf("\treward 1");
+        else if(j == N_REWARD_BUCKETS - 1)
+            printf("\treward %d+", 1 << j);
+        else
+            printf("\treward %d-%d", 1 << j, (1 << (j + 1)) - 1);
+        printf(": %lu transactions, avg %.3f ms, max %.3f ms\n", count[j],
+               sum[j] / (double)count[j] / 1e3, max[j] / 1e3);
+    }
+}
+
+/* Prints all users' info */
+void printAllUsers(user *users, account *balances, unsigned long *conf)
+{
+    int i = 0;
+    user u;
+
+    printf("\n\n===============USERS==============\n");
+    for(i = 0; i < conf[SO_USERS_NUM]; i++){
+        seqReadCopy(&users[i].seq, &u, &users[i], sizeof(u));
+        printf("\tPID: %d\n", u.pid);
+        printf("\tBudget: %d\n\n", committedBudget(balances, i, conf));
+    }
+}
+
+/* Prints the richest and poorest users */
+void printMostRelevantUsers(user *users, account *balances, 
+                            unsigned long *conf)
+{
+    int i = 0;
+    pid_t pid_min = 0;
+    pid_t pid_max = 0;
+    int min = INT_MAX;
+    int max = INT_MIN;
+    int budget = 0;
+    user u;
+
+    printf("\n\n===============RICHEST & POOREST USERS==============\n");
+    for(i = 0; i < conf[SO_USERS_NUM]; i++){
+        seqReadCopy(&users[i].seq, &u, &users[i], sizeof(u));
+        budget = committedBudget(balances, i, conf);
+        if(budget < min){
+            min = budget;
+            pid_min = u.pid;
+        }
+        if(budget > max){
+            max = budget;
+            pid_max = u.pid;
+        }
+    }
+
+    printf("Poorest:\n");
+    printf("\tPID: %d\n", pid_min);
+    printf("\tBudget: %d\n\n", min);
+    printf("Richest:\n");
+    printf("\tPID: %d\n", pid_max);
+    printf("\tBudget: %d\n\n", max);
+}
+
+/* Prints all nodes' info, the unprocessed transactions once ended */
+void printAllNodes(node *nodes, int nodes_num, int ended)
+{
+    int i = 0;
+    node n;
+
+    printf("\n\n===============NODES==============\n");
+    for(i = 0; i < nodes_num; i++){
+        seqReadCopy(&nodes[i].seq, &n, &nodes[i], sizeof(n));
+        printf("\tPID: %d\n", n.pid);
+        printf("\tReward: %d\n", n.reward);
+        if(n.batches > 0)
+            printf("\tAverage batch fill: %.2f\n",
+                   n.batch_trans / (double)n.batches);
+        if(ended)
+            printf("\tUnprocessed transactions: %d\n\n", n.unproc_trans);
+        else
+            printf("\n");
+    }
+}
+
+/* Prints the richest and poorest nodes */
+void printMostRelevantNodes(node *nodes, int nodes_num)
+{
+    int i = 0;
+    pid_t pid_min = 0;
+    pid_t pid_max = 0;
+    int min = INT_MAX;
+    int max = INT_MIN;
+    node n;
+
+    printf("\n\n===============RICHEST & POOREST NODES==============\n");
+    for(i = 0; i < nodes_num; i++){
+        seqReadCopy(&nodes[i].seq, &n, &nodes[i], sizeof(n));
+        if(n.reward < min){
+            min = n.reward;
+            pid_min = n.pid;
+        }
+        if(n.reward > max){
+            max = n.reward;
+            pid_max = n.pid;
+        }
+    }
+
+    printf("Poorest:\n");
+    printf("\tPID: %d\n", pid_min);
+    printf("\tReward: %d\n\n", min);
+    printf("Richest:\n");
+    printf("\tPID: %d\n", pid_max);
+    printf("\tReward: %d\n\n", max);
+}
+
+/* 
+ * Prints the stats of every second: all the users and nodes if they are
+ * few, the richest and poorest ones otherwise
+ */
+void printActiveStats(user *users, account *balances, int active_users, 
+                      node *nodes, int nodes_num, int active_nodes, 
+                      unsigned long *conf)
+{
+    printf("\n\n===============ACTIVE==============\n");
+    printf("\tActive users: [%d/%lu]\n", active_users, conf[SO_USERS_NUM]);
+    printf("\tActive nodes: [%d/%d]\n\n", active_nodes, nodes_num);
+
+    if(conf[SO_USERS_NUM] < 6)
+        printAllUsers(users, balances, conf);
+    else
+        printMostRelevantUsers(users, balances, conf);
+
+    if(nodes_num < 6)
+        printAllNodes(nodes, nodes_num, 0);
+    else
+        printMostRelevantNodes(nodes, nodes_num);
+}
+
+/* Prints why the simulation ended */
+void printEndReason(int reason, unsigned int blocks, unsigned long *conf)
+{
+    if(reason == 1)
+        printf("Simulation ended: The blockchain is full -> [%u/%ld]\n",
+               blocks, (long)SO_REGISTRY_SIZE);
+    else if(reason == 2)
+        printf("Simulation ended: The execution lasted SO_SIM_SEC=%ld seconds.\n",
+               conf[SO_SIM_SEC]);
+    else if(reason == 3)
+        printf("Simulation ended: No more active users.\n");
+    else if(reason == 4)
+        printf("Simulation ended: Interrupt signal received.\n");
+}
+
+#pragma endregion /* STATISTICS */
@@ -22,38 +22,31 @@
 #ifndef _SYS_SHM_H
 #include <sys/shm.h>
 #endif
-#ifndef _SYS_MSG_H
-#include <sys/msg.h>
-#endif
 #ifndef _STDARG_H
 #include <stdarg.h>
 #endif
 #ifndef _STRING_H
 #include <string.h>
 #endif
+#ifndef _STDIO_H
+#include <stdio.h>
+#endif
 
 #ifndef __COMMON_H
 #define __COMMON_H 1
 
 /*** IPC Keys ***/
 
-#define SHM_USER_KEY 1004
-#define SHM_NODE_KEY 1826
-#define SHM_LIBROMASTRO_KEY 9001
-#define SHM_ENV_KEY 9800
-#define SHM_BLOCK_NUMBER 88888
+#define SHM_ARENA_KEY 1004
 
-#define SEM_USER_KEY 76543
-#define SEM_NODE_KEY 2009
-#define SEM_LIBROMASTRO_KEY 65432
 #define SEM_SIM_KEY 82141
-#define SEM_BLOCK_NUMBER 88889
-
-#define FTOK_PATHNAME_NODE "./bin/node"
 
 #define TRANS_REWARD_SENDER -1
 
 #define IPC_IDS_FILENAME "./out/ipc_ids"
+#define LEDGER_FILENAME "./out/libromastro"
+#define EXPORT_FILENAME "./out/blockchain"
+#define EXPORT_PART_FILENAME "./out/blockchain.part"
 
 union semun
 {
@@ -67,21 +60,58 @@ union semun
 
 /*** Custom Data Structures ***/
 
+/* Process-shared readers/writers lock, it lives in a shmem segment */
+typedef struct
+{
+    volatile int state;             /* Readers count, -1 if a writer has it */
+    volatile int readers_waiting;   /* Readers sleeping on readers_futex */
+    volatile int writers_waiting;   /* Writers sleeping on writers_futex */
+    volatile unsigned int readers_futex; /* Changed to wake the readers */
+    volatile unsigned int writers_futex; /* Changed to wake a writer */
+} shm_rwlock;
+
+/* Locks in the REGION_LOCKS region of the arena */
+#define LOCK_USERS 0
+#define LOCK_NODES 1
+#define N_SHM_LOCKS 2
+
+/* 
+ * Users and nodes slots take a whole cache line each, they are written
+ * only by their owner with the seqlock protocol (seq is odd while the
+ * owner is writing), so the readers copy a consistent snapshot.
+ */
+#define CACHE_LINE_SIZE 64
+
 /* Users type */
 typedef struct
 {
+    volatile unsigned int seq;
     pid_t pid;
     int budget;
     int alive;
-} user;
+    unsigned int redirects;  /* Pushes moved to another node, pool full */
+    unsigned int rejects;    /* Pushes failed on every node tried */
+} __attribute__((aligned(CACHE_LINE_SIZE))) user;
+
+/* Rewards grouped by powers of two: 1, 2-3, 4-7, ..., 128+ */
+#define N_REWARD_BUCKETS 8
 
 /* Nodes type */
 typedef struct
 {
+    volatile unsigned int seq;
     pid_t pid;
     int reward;
     int unproc_trans;
-} node;
+    unsigned int batches;      /* Wakeups with at least one transaction */
+    unsigned int batch_trans;  /* Transactions read in those wakeups */
+    unsigned int forwarded;    /* Transactions sent to a friend */
+    unsigned int to_master;    /* Transactions sent to the master */
+    /* Commit latency of the transactions, grouped by reward */
+    unsigned int lat_count[N_REWARD_BUCKETS];
+    unsigned long lat_sum_usec[N_REWARD_BUCKETS];
+    unsigned long lat_max_usec[N_REWARD_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) node;
 
 /* Transaction type */
 typedef struct
@@ -93,35 +123,174 @@ typedef struct
     int reward;
 } transaction;
 
-/* MsgQueue message */
-typedef struct{
-    long mtype;
+/* Transaction pool slot */
+typedef struct
+{
+    volatile unsigned long seq; /* Position of the slot in the ring */
+    int hops;                   /* Times the transaction was forwarded */
     transaction trans;
-} msgbuf;
+} tp_slot;
+
+/* 
+ * Transaction pool of a node, a ring of SO_TP_SIZE slots in shmem where
+ * many users write and only the node reads. The slots follow the header.
+ * The pool after the nodes' ones belongs to the master, the nodes send
+ * there the transactions forwarded more than SO_HOPS times.
+ */
+typedef struct
+{
+    /* Written by the users */
+    volatile unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    /* Written by the node */
+    volatile unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+    volatile int sleeping;      /* The node waits on futex */
+    volatile unsigned int futex;
+    unsigned long capacity;
+} tpool;
+
+/* 
+ * Block for Libro Mastro. With LEDGER_SOA (make soa=1) every field of the
+ * transactions is a column of the block, a scan of some fields doesn't 
+ * load the others. The fields are read and written with the BLOCK_ macros
+ * and blockRead()/blockWrite(), never by name.
+ */
+#ifdef LEDGER_SOA
+#define LEDGER_LAYOUT 1
+#define LEDGER_LAYOUT_NAME "columns (SoA)"
 
-/* Block for Libro Mastro */
 typedef struct
 {
     unsigned int block_number;
+    int published;      /* Set to 1 when the block can be read */
+    int senders[SO_BLOCK_SIZE];
+    int receivers[SO_BLOCK_SIZE];
+    int quantities[SO_BLOCK_SIZE];
+    int rewards[SO_BLOCK_SIZE];
+    struct timespec timestamps[SO_BLOCK_SIZE];
+} block;
+
+#define BLOCK_SENDER(b, i) ((b)->senders[i])
+#define BLOCK_RECEIVER(b, i) ((b)->receivers[i])
+#define BLOCK_QUANTITY(b, i) ((b)->quantities[i])
+#define BLOCK_REWARD(b, i) ((b)->rewards[i])
+#define BLOCK_TIMESTAMP(b, i) ((b)->timestamps[i])
+#else
+#define LEDGER_LAYOUT 0
+#define LEDGER_LAYOUT_NAME "transactions (AoS)"
+
+typedef struct
+{
+    unsigned int block_number;
+    int published;      /* Set to 1 when the block can be read */
     transaction transBlock[SO_BLOCK_SIZE];
 } block;
 
-/* List of sent transactions */
-struct pendingTr
+#define BLOCK_SENDER(b, i) ((b)->transBlock[i].sender)
+#define BLOCK_RECEIVER(b, i) ((b)->transBlock[i].receiver)
+#define BLOCK_QUANTITY(b, i) ((b)->transBlock[i].quantity)
+#define BLOCK_REWARD(b, i) ((b)->transBlock[i].reward)
+#define BLOCK_TIMESTAMP(b, i) ((b)->transBlock[i].timestamp)
+#endif
+
+/* 
+ * Libro Mastro block counters (in the header of the Libro Mastro file):
+ *      0 published, the blocks before it can be read without locks
+ *      1 reserved, next slot of the Libro Mastro given to a node
+ */
+#define BLOCK_PUBLISHED 0
+#define BLOCK_RESERVED 1
+#define N_BLOCK_COUNTERS 2
+
+/* 
+ * Libro Mastro file: the header and SO_REGISTRY_SIZE blocks, mapped 
+ * MAP_SHARED by the master and the nodes. The nodes commit the blocks
+ * straight into it, the published ones are on disk after a crash too.
+ * checksum is the XOR of ledgerBlockChecksum() of the written blocks,
+ * the same for both the layouts.
+ */
+#define LEDGER_MAGIC 0x4d52424c
+#define LEDGER_VERSION 2
+
+typedef struct
+{
+    unsigned int magic;         /* LEDGER_MAGIC */
+    unsigned int version;       /* LEDGER_VERSION of the format */
+    unsigned int block_size;    /* SO_BLOCK_SIZE */
+    unsigned int registry_size; /* SO_REGISTRY_SIZE */
+    unsigned int block_bytes;   /* sizeof(block) */
+    unsigned int layout;        /* LEDGER_LAYOUT of the blocks */
+    unsigned int blocks_offset; /* Offset of the first block */
+    unsigned int block_number[N_BLOCK_COUNTERS]; /* Published is the count */
+    unsigned int checksum;      /* Of the written blocks */
+} ledger_header;
+
+/* Committed balance of a user, updated by the nodes */
+typedef struct
 {
-    transaction trans;
-    struct pendingTr *next;
-};
+    int credits;    /* Sum of the received quantities */
+    int debits;     /* Sum of the sent quantities and rewards */
+} account;
 
 /* configuration */
-#define N_RUNTIME_CONF_VALUES 13
+#define N_RUNTIME_CONF_VALUES 21
+/* The values after these ones are optional and have a default */
+#define N_REQUIRED_CONF_VALUES 13
 #define N_COMPILETIME_CONF_VALUES 2
 
 enum conf_index {
 	SO_USERS_NUM, SO_NODES_NUM, SO_BUDGET_INIT, SO_REWARD, 
 	SO_MIN_TRANS_GEN_NSEC, SO_MAX_TRANS_GEN_NSEC, SO_RETRY, 
 	SO_TP_SIZE, SO_MIN_TRANS_PROC_NSEC, SO_MAX_TRANS_PROC_NSEC, 
-	SO_SIM_SEC, SO_FRIENDS_NUM, SO_HOPS
+	SO_SIM_SEC, SO_FRIENDS_NUM, SO_HOPS, 
+	SO_TRANS_BURST, SO_PRIORITY, SO_MAX_NODES, SO_HUGE_PAGES, SO_PREFAULT,
+	SO_PLACEMENT, SO_VIRTUAL_TIME, SO_SEED
+};
+
+/* 
+ * Shared memory arena: a single segment with all the shared data. The
+ * header at its start has the offsets of the regions, every region 
+ * starts at a cache line.
+ */
+#define ARENA_MAGIC 0x4c4d4152
+#define ARENA_VERSION 2
+
+enum arena_region {
+	REGION_CONF, REGION_USERS, REGION_NODES, REGION_BALANCES, 
+	REGION_LOCKS, REGION_POOLS, REGION_NODES_NUM, N_ARENA_REGIONS
+};
+
+typedef struct
+{
+    unsigned int magic;         /* ARENA_MAGIC */
+    unsigned int version;       /* ARENA_VERSION of the layout */
+    int huge_pages;             /* 1 if backed by huge pages */
+    size_t size;                /* Bytes of the arena */
+    size_t offset[N_ARENA_REGIONS + 1]; /* The last one is the end */
+} arena_header;
+
+/* 
+ * Text export of the Libro Mastro: the published blocks are appended to 
+ * part_path (EXPORT_PART_FILENAME) while the simulation runs, at the end
+ * the header goes in path (EXPORT_FILENAME) and the blocks are copied 
+ * after it
+ */
+#define EXPORT_BUFFER_SIZE (1 << 20)
+
+typedef struct
+{
+    const char *path;       /* Written at the end */
+    const char *part_path;  /* Blocks exported so far */
+    FILE *fp;               /* part_path */
+    char *buffer;           /* Buffer of fp */
+    unsigned int blocks;    /* Blocks already exported */
+} block_export;
+
+/* 
+ * Arguments given by the master to the users and the nodes: the index
+ * of their slot in the table and the IDs of the IPC objects
+ */
+enum spawn_arg {
+	ARG_INDEX = 1, ARG_SEM_SIMULATION, ARG_SHM_ARENA, N_SPAWN_ARGS
 };
 
 /*** Semaphore Management ***/
@@ -139,20 +308,112 @@ sigset_t unblock_signals(int count, ...);
 void reset_signals(sigset_t old_mask);
 struct sigaction set_handler(int sig, void (*func)(int));
 
+/*** Futex Management ***/
+
+int futexWait(volatile unsigned int *addr, unsigned int val, 
+              const struct timespec *timeout);
+int futexWake(volatile unsigned int *addr, int count);
+
+/*** Seqlock Management ***/
+
+void seqWriteBegin(volatile unsigned int *seq);
+void seqWriteEnd(volatile unsigned int *seq);
+void seqReadCopy(volatile unsigned int *seq, void *dst, const void *src, 
+                 size_t size);
+
 /*** Shared Memory Management ***/
+
+void initRWLock(shm_rwlock *lock);
+void initReadFromShm(shm_rwlock *lock);
+void endReadFromShm(shm_rwlock *lock);
+void initWriteInShm(shm_rwlock *lock);
+void endWriteInShm(shm_rwlock *lock);
+
+/*** Arena Management ***/
+
+size_t arenaLayout(arena_header *arena, unsigned long *conf);
+void *arenaRegion(arena_header *arena, int region);
+int arenaCheck(arena_header *arena);
+void arenaPrefault(arena_header *arena, int region);
+
+/*** Libro Mastro File ***/
+
+size_t ledgerSize();
+ledger_header *ledgerMap(const char *path, int create);
+void ledgerSync(ledger_header *ledger);
+void ledgerUnmap(ledger_header *ledger);
+block *ledgerBlocks(ledger_header *ledger);
+unsigned int ledgerBlockChecksum(block *b);
+void blockRead(block *b, int i, transaction *trans);
+void blockWrite(block *b, unsigned int number, transaction *trans);
+void ledgerApplyBalances(block *b, account *balances, int (*userIndex)(int));
+int ledgerPublish(ledger_header *ledger);
+block *ledgerCommit(ledger_header *ledger, transaction *trans,
+                    account *balances, int (*userIndex)(int),
+                    int *reward, int *last);
+
+/*** Blockchain Export ***/
+
+int exportOpen(block_export *ex, const char *path, const char *part_path);
+void exportBlocks(block_export *ex, block *blocks, unsigned int published);
+int exportClose(block_export *ex, block *blocks, unsigned int published);
+
+/*** Transaction Pool Management ***/
+
+size_t tpSize(unsigned long capacity);
+tpool *tpGet(void *pools, int index, unsigned long capacity);
+void tpInit(tpool *pool, unsigned long capacity);
+int tpPush(tpool *pool, transaction *trans, int count, int *hops);
+int tpPeek(tpool *pool, transaction *trans, int *hops, int max);
+void tpDrop(tpool *pool, int count);
+int tpPopBatch(tpool *pool, transaction *trans, int max);
+void tpWait(tpool *pool, const struct timespec *timeout);
+unsigned long tpCount(tpool *pool);
+
+/*** Configuration ***/
+
+int readConfiguration(unsigned long *conf);
+
+/*** Random Number Utility ***/
+
 /* 
- * Semaphore values:
- *      0 write
- *      1 mutex
- *      2 readcount
+ * Every user and node slot has its own stream of the run seed SO_SEED,
+ * the same seed replays the same random numbers in every slot
  */
-void initReadFromShm(int);
-void endReadFromShm(int);
-void initWriteInShm(int);
-void endWriteInShm(int);
+#define USER_STREAM(index) ((unsigned int)(index))
+#define NODE_STREAM(index) ((unsigned int)(conf[SO_USERS_NUM] + (index)))
 
-/*** Random Number Utility ***/
+/* State of a xoshiro128** generator, the words are 32 bit */
+typedef struct
+{
+	unsigned int s[4];
+} rng_state;
 
+void rngSeed(rng_state *rng, unsigned long seed, unsigned int stream);
+unsigned int rngNext(rng_state *rng);
+int rngRange(rng_state *rng, int min, int max);
+void initRandom(unsigned long seed, unsigned int stream);
 int randomNum(int min, int max);
 
+/*** Statistics ***/
+
+int rewardBucket(int reward);
+void blockLatencies(block *b, struct timespec *now, unsigned int *count,
+                    unsigned long *sum_usec, unsigned long *max_usec);
+int committedBudget(account *balances, int index, unsigned long *conf);
+void printBlockRate(unsigned int blocks, struct timespec *begin,
+                    struct timespec *end);
+void printBatchFill(node *nodes, int nodes_num);
+void printPushStats(user *users, unsigned long *conf);
+void printCommitLatency(node *nodes, int nodes_num, int priority);
+void printAllUsers(user *users, account *balances, unsigned long *conf);
+void printMostRelevantUsers(user *users, account *balances, 
+                            unsigned long *conf);
+void printAllNodes(node *nodes, int nodes_num, int ended);
+void printMostRelevantNodes(node *nodes, int nodes_num);
+void printActiveStats(user *users, account *balances, int active_users, 
+                      node *nodes, int nodes_num, int active_nodes, 
+                      unsigned long *conf);
+void printEndReason(int reason, unsigned int blocks, unsigned long *conf);
+
 #endif /* __COMMON_H */
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>      /* printf(), fopen() */
+#include <stdlib.h>     /* malloc(), free() */
+#include <limits.h>     /* IOV_MAX */
+#include <unistd.h>     /* sysconf(), unlink() */
+#include <fcntl.h>      /* open() */
+#include <errno.h>      /* errno */
+#include <pthread.h>    /* pthread_create(), pthread_join() */
+#include <sys/uio.h>    /* writev() */
+#include "common.h"
+#include "bashprint.h"
+
+/*
+ * Text dump of the Libro Mastro file, the same out/blockchain written by
+ * the master, made from out/libromastro. Every thread formats a range of
+ * blocks in its own buffer without printf(), then the buffers are written
+ * in order with a single writev().
+ *
+ * Usage: bin/dump [-b] [threads]
+ *      -b       benchmark: the same dump is also written with fprintf() 
+ *               like the export of the master, the times are printed and
+ *               the two files must be byte-identical. Both go in their
+ *               own files, out/blockchain of a simulation is not touched
+ *      threads  a thread per core by default
+ */
+
+/* Maximum bytes of a block: 11 bytes for every int */
+#define BLOCK_LINE_MAX (7 + 11 + 2)
+#define TRANS_LINE_MAX (44 + 7 * 11)
+#define BLOCK_TEXT_MAX (BLOCK_LINE_MAX + SO_BLOCK_SIZE * TRANS_LINE_MAX)
+
+#define FAST_FILENAME "./out/blockchain.fast"
+#define STDIO_FILENAME "./out/blockchain.stdio"
+#define STDIO_PART_FILENAME "./out/blockchain.stdio.part"
+
+/* Range of blocks formatted by a thread */
+typedef struct
+{
+    pthread_t thread;
+    unsigned int first;     /* First block of the range */
+    unsigned int last;      /* The block after the range */
+    char *text;             /* Formatted blocks */
+    size_t len;             /* Bytes in text */
+} dump_range;
+
+/* -------------------- PROTOTYPES -------------------- */
+
+int dump_parallel(const char *path, int threads);
+void *format_range(void *arg);
+char *format_int(char *p, int value);
+char *format_str(char *p, const char *s, size_t len);
+int write_all(int fd, struct iovec *iov, int count);
+int dump_stdio();
+int same_files(const char *a, const char *b);
+double elapsed_msec(struct timespec *begin);
+
+/* -------------------- GLOBAL VARIABLES -------------------- */
+
+ledger_header *ledger;        /* Libro Mastro file, the blocks follow */
+block *libroMastroArray;      /* Array of blocks of the Libro Mastro */
+unsigned int blocks;          /* Published blocks */
+
+int main(int argc, char **argv)
+{
+    struct timespec begin;
+    double stdio_msec = 0;
+    double fast_msec = 0;
+    int bench = (argc > 1 && strcmp(argv[1], "-b") == 0);
+    int threads = 0;
+
+    if(argc > 1 + bench)
+        threads = atoi(argv[1 + bench]);
+    else
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    ledger = ledgerMap(LEDGER_FILENAME, 0);
+    if(ledger == NULL){
+        MSG_ERR("dump: error while mapping the Libro Mastro file, is it made by this build?");
+        perror("\t" LEDGER_FILENAME);
+        exit(EXIT_FAILURE);
+    }
+    libroMastroArray = ledgerBlocks(ledger);
+    blocks = ledger->block_number[BLOCK_PUBLISHED];
+
+    /* No more threads than the blocks */
+    if(threads > (int)blocks)
+        threads = blocks;
+    if(threads > IOV_MAX - 1)
+        threads = IOV_MAX - 1;
+    if(threads < 1)
+        threads = 1;
+
+    if(bench){
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if(dump_stdio() == -1){
+            MSG_ERR("dump: error while writing " STDIO_FILENAME ".");
+            perror("\texport ");
+            fprintf(stderr, "\tthe blocks are kept in " STDIO_PART_FILENAME "\n");
+            exit(EXIT_FAILURE);
+        }
+        stdio_msec = elapsed_msec(&begin);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if(dump_parallel(bench ? FAST_FILENAME : EXPORT_FILENAME, threads) == -1){
+        MSG_ERR("dump: error while writing the dump.");
+        perror("\tdump ");
+        exit(EXIT_FAILURE);
+    }
+    fast_msec = elapsed_msec(&begin);
+
+    printf("Blocks: %u of %d transactions\n", blocks, SO_BLOCK_SIZE);
+    if(bench){
+        printf("fprintf() export: %.3f ms\n", stdio_msec);
+        printf("Parallel dump: %.3f ms with %d threads\n", fast_msec,
+               threads);
+        if(!same_files(STDIO_FILENAME, FAST_FILENAME)){
+            MSG_ERR("dump: the two dumps are different, see " STDIO_FILENAME " and " FAST_FILENAME ".");
+            exit(EXIT_FAILURE);
+        }
+        unlink(STDIO_FILENAME);
+        unlink(FAST_FILENAME);
+        MSG_OK("The dumps are byte-identical.");
+    } else {
+        printf("Dump: %.3f ms with %d threads -> %s\n", fast_msec, threads,
+               EXPORT_FILENAME);
+    }
+
+    ledgerUnmap(ledger);
+    return 0;
+}
+
+/*
+ * Splits the blocks in a range per thread, then writes the header and
+ * the ranges in order
+ */
+int dump_parallel(const char *path, int threads)
+{
+    char header[128];
+    struct iovec iov[IOV_MAX];
+    dump_range *ranges;
+    unsigned int per_thread = 0;
+    int started = 0;
+    int err = 0;
+    int fd = -1;
+    int i = 0;
+
+    ranges = calloc(threads, sizeof(dump_range));
+    if(ranges == NULL)
+        return -1;
+    per_thread = (blocks + threads - 1) / threads;
+    for(i = 0; i < threads; i++){
+        ranges[i].first = i * per_thread;
+        ranges[i].last = ranges[i].first + per_thread;
+        if(ranges[i].first > blocks)
+            ranges[i].first = blocks;
+        if(ranges[i].last > blocks)
+            ranges[i].last = blocks;
+    }
+
+    /* The first range is formatted by the main thread */
+    for(i = 1; i < threads && err == 0; i++){
+        err = pthread_create(&ranges[i].thread, NULL, format_range,
+                             &ranges[i]);
+        if(err == 0)
+            started++;
+    }
+    format_range(&ranges[0]);
+    for(i = 1; i <= started; i++)
+        pthread_join(ranges[i].thread, NULL);
+    for(i = 0; i < threads && err == 0; i++)
+        if(ranges[i].text == NULL)
+            err = ENOMEM;
+
+    if(err == 0){
+        sprintf(header, "\n\n===============BLOCKCHAIN==============\n"
+                        "# of blocks: %d\n", blocks);
+        iov[0].iov_base = header;
+        iov[0].iov_len = strlen(header);
+        for(i = 0; i < threads; i++){
+            iov[i + 1].iov_base = ranges[i].text;
+            iov[i + 1].iov_len = ranges[i].len;
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1 || write_all(fd, iov, threads + 1) == -1)
+            err = errno;
+        if(fd != -1)
+            close(fd);
+    }
+
+    for(i = 0; i < threads; i++)
+        free(ranges[i].text);
+    free(ranges);
+    errno = err;
+    return err != 0 ? -1 : 0;
+}
+
+/* Thread: formats the blocks of the range, the same lines of exportBlocks() */
+void *format_range(void *arg)
+{
+    dump_range *r = (dump_range *)arg;
+    block *b;
+    char *p;
+    unsigned int i = 0;
+    int j = 0;
+
+    r->text = malloc((size_t)(r->last - r->first) * BLOCK_TEXT_MAX + 1);
+    if(r->text == NULL)
+        return NULL;
+
+    p = r->text;
+    for(i = r->first; i < r->last; i++){
+        b = &libroMastroArray[i];
+        p = format_str(p, "Block #", 7);
+        p = format_int(p, i);
+        p = format_str(p, ":\n", 2);
+        for(j = 0; j < SO_BLOCK_SIZE; j++){
+            p = format_str(p, "\tTransaction #", 14);
+            p = format_int(p, j);
+            p = format_str(p, ": t=", 4);
+            /* Printed with %d by the export */
+            p = format_int(p, (int)BLOCK_TIMESTAMP(b, j).tv_sec);
+            p = format_str(p, ".", 1);
+            p = format_int(p, (int)BLOCK_TIMESTAMP(b, j).tv_nsec);
+            p = format_str(p, "\t snd=", 6);
+            p = format_int(p, BLOCK_SENDER(b, j));
+            p = format_str(p, "\t rcv=", 6);
+            p = format_int(p, BLOCK_RECEIVER(b, j));
+            p = format_str(p, "\t qty=", 6);
+            p = format_int(p, BLOCK_QUANTITY(b, j));
+            p = format_str(p, "\t rwd=", 6);
+            p = format_int(p, BLOCK_REWARD(b, j));
+            p = format_str(p, "\n", 1);
+        }
+    }
+    r->len = p - r->text;
+    return NULL;
+}
+
+/* Writes value in decimal like %d, returns the end */
+char *format_int(char *p, int value)
+{
+    char digits[11];
+    unsigned int u = value;
+    int n = 0;
+
+    if(value < 0){
+        *p++ = '-';
+        u = -u;
+    }
+    do{
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while(u > 0);
+    while(n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+/* Copies len bytes of s, returns the end */
+char *format_str(char *p, const char *s, size_t len)
+{
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/* writev() until all the buffers are written */
+int write_all(int fd, struct iovec *iov, int count)
+{
+    ssize_t n = 0;
+
+    while(count > 0){
+        n = writev(fd, iov, count);
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* Skips the buffers written, the last one may be written in part */
+        while(count > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* 
+ * The dump of the master's export, one fprintf() per transaction, in 
+ * STDIO_FILENAME
+ */
+int dump_stdio()
+{
+    block_export ex;
+
+    if(exportOpen(&ex, STDIO_FILENAME, STDIO_PART_FILENAME) == -1)
+        return -1;
+    return exportClose(&ex, libroMastroArray, blocks);
+}
+
+/* Returns 1 if the two files have the same bytes */
+int same_files(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "r");
+    FILE *fb = fopen(b, "r");
+    int ca = 0, cb = 0;
+
+    if(fa != NULL && fb != NULL){
+        do{
+            ca = getc(fa);
+            cb = getc(fb);
+        } while(ca == cb && ca != EOF);
+    } else {
+        ca = 1;
+    }
+    if(fa != NULL)
+        fclose(fa);
+    if(fb != NULL)
+        fclose(fb);
+    return ca == cb;
+}
+
+/* Milliseconds from begin */
+double elapsed_msec(struct timespec *begin)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) * 1e3
+           + (now.tv_nsec - begin->tv_nsec) / 1e6;
+}
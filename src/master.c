@@ -5,8 +5,14 @@
 #include <limits.h>     /* Limits of numbers macros */ 
 #include <string.h>     /* stderr */
 #include <signal.h>		/* kill(), SIG* */
-#include <errno.h>      /* errno */
 #include <time.h>       /* time(), struct timespec */
+#include <errno.h>      /* errno */
+#include <spawn.h>      /* posix_spawn() */
+#include <sched.h>      /* sched_setaffinity(), cpu_set_t */
+#include <unistd.h>     /* syscall(), access() */
+#include <sys/syscall.h>    /* SYS_mbind */
+#include <linux/mempolicy.h> /* MPOL_PREFERRED */
+#include <pthread.h>    /* pthread_create(), pthread_join() */
 #include "common.h"
 #include "bashprint.h"
 
@@ -14,13 +20,22 @@
 #define FORCE_PRINT_STATS 1
 /* The print_stats(int) function will just print the useful info */
 #define PRINT_USEFUL_STATS 0
-
-/* only used by get_configuration() as env. variable names */
-const char conf_names[N_RUNTIME_CONF_VALUES][22+1] = {
-	"SO_USERS_NUM", "SO_NODES_NUM", "SO_BUDGET_INIT", "SO_REWARD",
-	"SO_MIN_TRANS_GEN_NSEC", "SO_MAX_TRANS_GEN_NSEC", "SO_RETRY",
-	"SO_TP_SIZE", "SO_MIN_TRANS_PROC_NSEC", "SO_MAX_TRANS_PROC_NSEC", 
-	"SO_SIM_SEC", "SO_FRIENDS_NUM", "SO_HOPS"
+/* The master tries again after this time when all the pools are full */
+#define PLACE_RETRY_NSEC 1000000
+/* 
+ * A new node is spawned when the pools are filled over SPAWN_OCCUPANCY 
+ * percent for SPAWN_CHECKS seconds in a row
+ */
+#define SPAWN_OCCUPANCY 75
+#define SPAWN_CHECKS 2
+/* NUMA nodes looked up in /sys/devices/system/node */
+#define MAX_NUMA_NODES 64
+/* The export writer looks for new published blocks this often */
+#define EXPORT_PERIOD_NSEC 100000000
+
+/* Only used by wr_ids_to_file() */
+const char region_names[N_ARENA_REGIONS][16] = {
+	"conf", "users", "nodes", "balances", "locks", "pools", "nodesNum"
 };
 
 /* -------------------- PROTOTYPES -------------------- */
@@ -30,18 +45,31 @@ void init();
 void init_conf();
 void init_semaphores();
 void init_sharedmem();
+size_t huge_page_size();
 void wr_ids_to_file(char mode);
 void init_sighandlers();
 void get_configuration(unsigned long *conf);
 void users_generation();
 void nodes_generation();
+void spawn_node(int i);
+void init_spawn_args();
+pid_t spawn_child(char *path, char *name, int index);
+void wait_barrier();
+void init_placement();
+void place_master(int node_index);
+int cpu_numa_node(int cpu);
+void bind_arena(size_t size);
+void cpus_to_string(cpu_set_t *set, char *buf, int len);
+void start_export_writer();
 
 /* Lifetime */
 void print_stats(int force_print);
-void print_all_users();
-void print_most_relevant_users();
-void print_all_nodes();
-void print_most_relevant_nodes();
+void *export_writer(void *arg);
+void stop_export_writer();
+void wait_nodes_exit();
+int place_transactions();
+void check_saturation();
+void print_forward_stats();
 
 /* Signal Handlers  */
 void sigterm_handler(int signum);
@@ -57,28 +85,48 @@ void clean_end();
 /* -------------------- GLOBAL VARIABLES -------------------- */
 
 /**** SHARED MEMORY IDs ****/
-int shmConfig;        /* ID shmem configuration */
-int shmUsers;         /* ID shmem users data */
-int shmNodes;         /* ID shmem nodes data */
-int shmLibroMastro;   /* ID shmem Libro Mastro */
-int shmBlockNumber;   /* ID shmem libro mastro block number */
+int shmArena;         /* ID shmem arena, all the shared data */
 
 /**** SHARED MEMORY ATTACHED VARIABLES ****/
+arena_header *arena;          /* Shmem arena, the regions follow */
 user *shmUsersArray;          /* Shmem Array of User PIDs */
 node *shmNodesArray;          /* Shmem Array of Node PIDs */
-block *libroMastroArray;      /* Shmem Array of blocks */
-unsigned int *block_number;   /* Shmem number of the last block */
+ledger_header *ledger;        /* Libro Mastro file, the blocks follow */
+block *libroMastroArray;      /* Array of blocks of the Libro Mastro */
+unsigned int *block_number;   /* Libro Mastro block counters */
 unsigned long *conf;          /* Shmem Array of configuration values */
-
-/**** MESSAGE QUEUE IDs ****/
-int *msgTransactions; /* Msg queues IDs Array */
+unsigned long env_conf[N_RUNTIME_CONF_VALUES]; /* Read before the arena */
+account *balancesArray;       /* Shmem Array of committed balances */
+shm_rwlock *locksArray;       /* Shmem Array of readers/writers locks */
+void *poolsArray;             /* Shmem transaction pools of the nodes */
+tpool *masterPool;            /* Transactions forwarded too many times */
+int *nodes_num;               /* Shmem number of nodes in the table */
 
 /**** SEMAPHORE IDs ****/
-int semUsers;        /* Semaphore for shmem access on the Array of User PIDs */
-int semNodes;        /* Semaphore for shmem access on the Array of Node PIDs */
-int semLibroMastro;  /* Semaphore for shmem access on the Libro Mastro */
 int semSimulation;   /* Semaphore for the simulation */
-int semBlockNumber;  /* Semaphore for the last block number */
+
+/**** CHILDREN ARGUMENTS ****/
+char spawn_args[N_SPAWN_ARGS][12]; /* Slot index and IPC IDs */
+char *spawn_argv[N_SPAWN_ARGS + 1];
+
+/**** PLACEMENT ****/
+int node_cpus[CPU_SETSIZE]; /* Dedicated CPUs of the nodes */
+int n_node_cpus;            /* 0 when no placement is applied */
+cpu_set_t users_cpus;       /* CPUs shared by the users and the master */
+int numa_node;              /* NUMA node of the nodes' CPUs */
+int numa_nodes;             /* NUMA nodes of the system */
+char placement_info[256];   /* Placement applied, printed in the stats */
+
+/**** BLOCKCHAIN EXPORT ****/
+block_export blockExport;  /* Published blocks written during the run */
+pthread_t exportThread;    /* Writer of the published blocks */
+int export_started;        /* Boolean, the writer must be joined */
+volatile unsigned int export_stop; /* Set to 1 to stop the writer */
+double export_msec;        /* Time of the export at the end */
+
+/**** LOCKS ****/
+shm_rwlock *lockUsers; /* Lock for shmem access on the Array of User PIDs */
+shm_rwlock *lockNodes; /* Lock for shmem access on the Array of Node PIDs */
 
 /**** STATISTICAL VARIABLES ****/
 int remaining_users; /* Number of active users */
@@ -88,53 +136,86 @@ int nodes_generated; /* Boolean to 1 if the nodes were generated */
 int users_generated; /* Boolean to 1 if the users were generated */
 int term_reason;     /* Defines reason of termination */
 int early_deaths;    /* Number of early death users */
+unsigned long placed; /* Transactions moved by the master to a node */
+int spawned;         /* Nodes spawned at runtime */
+int saturated;       /* Seconds in a row with the pools saturated */
+struct timespec sim_start; /* Start time of the simulation */
+struct timespec sim_end;   /* Start of the termination */
+struct timespec startup_begin; /* Time of the first spawn */
+double startup_msec; /* From the first spawn to the barrier */
 
 int main (int argc, char ** argv)
 {
     /* To print the stats every second */
-    struct timespec req = {1, 0};
-    struct timespec rem;
-    int nanofail = 0;
+    struct timespec next;
+    struct timespec now;
+    struct timespec req;
+    int placed_all = 1;
 
     /* (1): Get simulation configuration, initialize IPC Objects */
     init_sighandlers();
     init();
 
     /* (2): Generate child processes */
+    clock_gettime(CLOCK_MONOTONIC, &startup_begin);
     nodes_generation();
     nodes_generated = 1;
     /* For statistical purposes */
     remaining_nodes = conf[SO_NODES_NUM];
 
-    /* Write msgqueue IDs */
+    /* Write transaction pools */
     wr_ids_to_file('a');
     
     users_generation();
     users_generated = 1;
     /* When this integer reaches 0, the simulation must end */
     remaining_users = conf[SO_USERS_NUM];
+    wait_barrier();
 
     /* 
      * (3): Signal handling, signals to the Master are used to determine
      *      termination conditions.
      *      - Print stats every second. 
+     *      - Place the transactions forwarded too many times.
      */
 
+    clock_gettime(CLOCK_MONOTONIC, &sim_start);
+    next = sim_start;
+    next.tv_sec++;
     alarm(conf[SO_SIM_SEC]);
     while (1){
-        if(nanofail){
-            req = rem;
-            nanofail = 0;
-        } else {
-            req.tv_sec = 1;
-            req.tv_nsec = 0;
+    	block_signals(4, SIGINT, SIGTERM, SIGUSR1, SIGALRM);
+        placed_all = place_transactions();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec 
+                                        && now.tv_nsec >= next.tv_nsec)){
+            print_stats(PRINT_USEFUL_STATS);
+            check_saturation();
+            next.tv_sec++;
+        }
+    	unblock_signals(4, SIGINT, SIGTERM, SIGUSR1, SIGALRM);
+
+        /* 
+         * Sleeps until the next stats or a forwarded transaction,
+         * the signals wake the master too
+         */
+        req.tv_sec = next.tv_sec - now.tv_sec;
+        req.tv_nsec = next.tv_nsec - now.tv_nsec;
+        if(req.tv_nsec < 0){
+            req.tv_sec--;
+            req.tv_nsec += 1000000000L;
         }
-        if(nanosleep(&req, &rem) < 0){
-            nanofail = 1;
+        if(req.tv_sec < 0)
+            continue;
+        if(placed_all){
+            tpWait(masterPool, &req);
         } else {
-        	block_signals(4, SIGINT, SIGTERM, SIGUSR1, SIGALRM);
-            print_stats(PRINT_USEFUL_STATS);
-        	unblock_signals(4, SIGINT, SIGTERM, SIGUSR1, SIGALRM);
+            /* The master pool is not empty, tpWait would not sleep */
+            if(req.tv_sec > 0 || req.tv_nsec > PLACE_RETRY_NSEC){
+                req.tv_sec = 0;
+                req.tv_nsec = PLACE_RETRY_NSEC;
+            }
+            nanosleep(&req, NULL);
         }
     }
 
@@ -159,96 +240,46 @@ void init()
     users_generated = 0;
     term_reason = 0;
     early_deaths = 0;
+    placed = 0;
+    spawned = 0;
+    saturated = 0;
+    startup_msec = 0;
 
     /* Setting IPC IDs to -1 */
-    semUsers = -1;
-    semNodes = -1;
-    semLibroMastro = -1;
     semSimulation = -1;
-    semBlockNumber = -1;
-    shmConfig = -1;
-    shmUsers = -1;
-    shmNodes = -1;
-    shmLibroMastro = -1;
-    shmBlockNumber = -1;
+    shmArena = -1;
+    arena = NULL;
+    ledger = NULL;
+    blockExport.fp = NULL;
+    export_started = 0;
+    export_stop = 0;
+    export_msec = 0;
     
     init_conf();
+    init_placement();
     init_semaphores();
 	init_sharedmem();
 
+    start_export_writer();
+
     /* Write shmem and semaphore IDs */
     wr_ids_to_file('w');
-    /* 
-     * Message queues are created in nodes_generation(),
-     * this is just the array of Msg queue IDs
-     */
-    msgTransactions = (int*) malloc(conf[SO_NODES_NUM] * sizeof(int));
-    if(msgTransactions == NULL){
-        MSG_ERR("master.init(): msgTransactions, error while allocating "
-                "memory for msgqueue IDs");
-        perror("\tmsgTransactions: ");
-        shutdown(EXIT_FAILURE);
-    }
-    
-    /* Initializes seed for the random number generation */ 
-    srand(getpid()+getppid());
+    init_spawn_args();
 }
 
-/* Gets the configuration and write it in shared memory */
+/* Gets the configuration, it's copied in the arena once created */
 void init_conf()
 {
-    /* Creating the shared memory segment */
-    shmConfig = shmget( SHM_ENV_KEY, 
-                        sizeof(unsigned long) * N_RUNTIME_CONF_VALUES, 
-                        IPC_CREAT | IPC_EXCL | 0600);
-    if (shmConfig == -1){
-        MSG_ERR("master.init(): shmConfig, error while creating the shared memory segment.");
-        perror("\tshmConfig");
-        shutdown(EXIT_FAILURE);
-    }
-
-    conf = shmat(shmConfig, NULL, 0);
-    if(conf == (void *) -1){
-        MSG_ERR("master.init(): shmConfig, error while creating the shared memory segment.");
-        perror("\tshmConfig");
-        shutdown(EXIT_FAILURE);
-    }
-
-    /* Gets conf from Env variables, Writes configuration to shared memory */
-    get_configuration(conf);
+    /* Gets conf from Env variables */
+    get_configuration(env_conf);
+    conf = env_conf;
+    if(conf[SO_VIRTUAL_TIME])
+        MSG_WARNING("master.init(): SO_VIRTUAL_TIME is only used by bin/sim, the processes run in real time.");
 }
 
 /* Creates the semaphores and initializes them */
 void init_semaphores()
 {
-    semUsers = semget(SEM_USER_KEY, 3, IPC_CREAT | 0600);
-    if(semUsers == -1){
-		MSG_ERR("master.init(): semUsers, error while creating the semaphore.");
-        perror("\tsemUsers");
-		shutdown(EXIT_FAILURE);
-	}
-
-	semNodes = semget(SEM_NODE_KEY, 3, IPC_CREAT | 0600);
-    if(semNodes == -1){
-		MSG_ERR("master.init(): semNodes, error while creating the semaphore.");
-        perror("\tsemNodes");
-		shutdown(EXIT_FAILURE);
-	}
-
-	semLibroMastro = semget(SEM_LIBROMASTRO_KEY, 3, IPC_CREAT | 0600);
-    if(semLibroMastro == -1){
-		MSG_ERR("master.init(): semLibroMastro, error while creating the semaphore.");
-        perror("\tsemLibroMastro");
-		shutdown(EXIT_FAILURE);
-	}
-
-    semBlockNumber = semget(SEM_BLOCK_NUMBER, 3, IPC_CREAT | 0600);
-    if(semBlockNumber == -1){
-		MSG_ERR("master.init(): semBlockNumber, error while creating the semaphore.");
-        perror("\tsemBlockNumber");
-		shutdown(EXIT_FAILURE);
-	}
-
     semSimulation = semget(SEM_SIM_KEY, 1, IPC_CREAT | 0600);
     if(semSimulation == -1){
 		MSG_ERR("master.init(): semSimulation, error while creating the semaphore.");
@@ -256,74 +287,104 @@ void init_semaphores()
 		shutdown(EXIT_FAILURE);
 	}
 
-	initSemAvailable(semUsers, 0);
-    initSemAvailable(semUsers, 1);
-    initSemInUse(semUsers, 2);
-
-    initSemAvailable(semNodes, 0);
-    initSemAvailable(semNodes, 1);
-    initSemInUse(semNodes, 2);
-    
-    initSemAvailable(semLibroMastro, 0);
-    initSemAvailable(semLibroMastro, 1);
-    initSemInUse(semLibroMastro, 2);
-
     initSemSimulation(semSimulation, 0, conf[SO_USERS_NUM], 
                       conf[SO_NODES_NUM]);
-
-    initSemAvailable(semBlockNumber, 0);
-    initSemAvailable(semBlockNumber, 1);
-    initSemInUse(semBlockNumber, 2);
 }
 
-/* Creates the shmem segments */
+/* 
+ * Creates the shmem arena and initializes its regions. With SO_HUGE_PAGES
+ * the arena is rounded to the huge page size, if the system has no free
+ * huge pages normal pages are used.
+ */
 void init_sharedmem()
 {
-    /* Creating shmem segment for Users */
-    shmUsers = shmget(  SHM_USER_KEY, 
-                        sizeof(user) * conf[SO_USERS_NUM], 
-                        IPC_CREAT | IPC_EXCL | 0600);
-    if (shmUsers == -1){
-		MSG_ERR("master.init(): shmUsers, error while creating the shared memory segment.");
-        perror("\tshmUsers");
-		shutdown(EXIT_FAILURE);
-	}
-    shmUsersArray = (user *)shmat(shmUsers, NULL, 0);
-
-    /* Creating shmem segment for Nodes */
-    shmNodes = shmget(  SHM_NODE_KEY, 
-                        sizeof(node) * conf[SO_NODES_NUM], 
-                        IPC_CREAT | IPC_EXCL | 0600);
-    if (shmNodes == -1){
-		MSG_ERR("master.init(): shmNodes, error while creating the shared memory segment.");
-        perror("\tshmNodes");
-		shutdown(EXIT_FAILURE);
-	}
-    shmNodesArray = (node *)shmat(shmNodes, NULL, 0);
-
-    /* Creating shmem segment for the Libro Mastro */
-    shmLibroMastro = shmget(SHM_LIBROMASTRO_KEY, 
-                            sizeof(block) * SO_REGISTRY_SIZE,
-                            IPC_CREAT | IPC_EXCL | 0600);
-    if (shmLibroMastro == -1){
-		MSG_ERR("master.init(): shmLibroMastro, error while creating the shared memory segment.");
-        perror("\tshmLibroMastro");
+    arena_header layout;
+    size_t size = 0;
+    size_t huge = 0;
+    int i = 0;
+
+    size = arenaLayout(&layout, conf);
+    if(conf[SO_HUGE_PAGES]){
+        huge = huge_page_size();
+        shmArena = shmget(SHM_ARENA_KEY, (size + huge - 1) / huge * huge, 
+                          IPC_CREAT | IPC_EXCL | SHM_HUGETLB | 0600);
+        if(shmArena == -1){
+            MSG_WARNING("master.init(): no huge pages for the arena, using normal pages.");
+            perror("\tshmArena");
+        } else {
+            layout.huge_pages = 1;
+        }
+    }
+    if(shmArena == -1)
+        shmArena = shmget(SHM_ARENA_KEY, size, IPC_CREAT | IPC_EXCL | 0600);
+    if(shmArena == -1){
+		MSG_ERR("master.init(): shmArena, error while creating the shared memory segment.");
+        perror("\tshmArena");
 		shutdown(EXIT_FAILURE);
 	}
-    libroMastroArray = (block *)shmat(shmLibroMastro, NULL, 0);
-
-    /* Creating shmem segment for the libro mastro's block number */
-    shmBlockNumber = shmget(SHM_BLOCK_NUMBER, 
-                            sizeof(unsigned int), 
-                            IPC_CREAT | IPC_EXCL | 0600);
-    if (shmBlockNumber == -1){
-		MSG_ERR("master.init(): shmBlockNumber, error while creating the shared memory segment.");
-        perror("\tshmBlockNumber");
-		shutdown(EXIT_FAILURE); 
-	}
-    /* Block number initialization */
-    block_number = (unsigned int *)shmat(shmBlockNumber, NULL, 0);
-    *block_number = 0;
+    arena = (arena_header *)shmat(shmArena, NULL, 0);
+    if(arena == (void *) -1){
+        MSG_ERR("master.init(): shmArena, error while attaching the shared memory segment.");
+        perror("\tshmArena");
+        arena = NULL;
+        shutdown(EXIT_FAILURE);
+    }
+    /* Before the pages are touched, they are allocated on the policy node */
+    if(n_node_cpus > 0 && numa_nodes > 1)
+        bind_arena(layout.huge_pages ? (size + huge - 1) / huge * huge : size);
+
+    /* New shmem segments are zero filled: no credits and no debits */
+    *arena = layout;
+    if(conf[SO_PREFAULT])
+        for(i = 0; i < N_ARENA_REGIONS; i++)
+            arenaPrefault(arena, i);
+    memcpy(arenaRegion(arena, REGION_CONF), env_conf, sizeof(env_conf));
+    conf = arenaRegion(arena, REGION_CONF);
+    shmUsersArray = arenaRegion(arena, REGION_USERS);
+    shmNodesArray = arenaRegion(arena, REGION_NODES);
+    balancesArray = arenaRegion(arena, REGION_BALANCES);
+    locksArray = arenaRegion(arena, REGION_LOCKS);
+    poolsArray = arenaRegion(arena, REGION_POOLS);
+    nodes_num = arenaRegion(arena, REGION_NODES_NUM);
+
+    lockUsers = &locksArray[LOCK_USERS];
+    lockNodes = &locksArray[LOCK_NODES];
+    initRWLock(lockUsers);
+    initRWLock(lockNodes);
+
+    *nodes_num = conf[SO_NODES_NUM];
+
+    /* A transaction pool for every node and the master's one */
+    for(i = 0; i <= conf[SO_MAX_NODES]; i++)
+        tpInit(tpGet(poolsArray, i, conf[SO_TP_SIZE]), conf[SO_TP_SIZE]);
+    masterPool = tpGet(poolsArray, conf[SO_MAX_NODES], conf[SO_TP_SIZE]);
+
+    /* A new file has no blocks, the block counters are 0 */
+    ledger = ledgerMap(LEDGER_FILENAME, 1);
+    if(ledger == NULL){
+        MSG_ERR("master.init(): error while creating the Libro Mastro file.");
+        perror("\t" LEDGER_FILENAME);
+        shutdown(EXIT_FAILURE);
+    }
+    libroMastroArray = ledgerBlocks(ledger);
+    block_number = ledger->block_number;
+}
+
+/* Size of the huge pages from /proc/meminfo, 2MB if not found */
+size_t huge_page_size()
+{
+    FILE *fp;
+    char line[128];
+    unsigned long kb = 2048;
+
+    fp = fopen("/proc/meminfo", "r");
+    if(fp != NULL){
+        while(fgets(line, sizeof(line), fp) != NULL)
+            if(sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+                break;
+        fclose(fp);
+    }
+    return kb * 1024;
 }
 
 /* Write ipc ids to file */
@@ -339,26 +400,33 @@ void wr_ids_to_file(char mode)
 
     if(mode == 'w'){
         fprintf(fp_ids, "SEMAPHORES\n");
-        fprintf(fp_ids, "\tsemUsers: %d\n", semUsers);
-        fprintf(fp_ids, "\tsemNodes: %d\n", semNodes);
-        fprintf(fp_ids, "\tsemLibroMastro: %d\n", semLibroMastro);
-        fprintf(fp_ids, "\tsemBlockNumber: %d\n", semBlockNumber);
         fprintf(fp_ids, "\tsemSimulation: %d\n\n", semSimulation);
         fprintf(fp_ids, "SHARED MEMORY\n");
-        fprintf(fp_ids, "\tshmConfig: %d\n", shmConfig);
-        fprintf(fp_ids, "\tshmUsers: %d\n", shmUsers);
-        fprintf(fp_ids, "\tshmNodes: %d\n", shmNodes);
-        fprintf(fp_ids, "\tshmLibroMastro: %d\n", shmLibroMastro);
-        fprintf(fp_ids, "\tshmBlockNumber: %d\n\n", shmBlockNumber);
-        fprintf(fp_ids, "MESSAGE QUEUES\n");
+        fprintf(fp_ids, "\tshmArena: %d, %lu bytes%s\n", shmArena, 
+                (unsigned long)arena->size, 
+                arena->huge_pages ? ", huge pages" : "");
+        for(i = 0; i < N_ARENA_REGIONS; i++)
+            fprintf(fp_ids, "\t\t%s: offset %lu, %lu bytes\n", 
+                    region_names[i], (unsigned long)arena->offset[i], 
+                    (unsigned long)(arena->offset[i + 1] 
+                                    - arena->offset[i]));
+        fprintf(fp_ids, "\n");
+        fprintf(fp_ids, "LIBRO MASTRO\n");
+        fprintf(fp_ids, "\t%s: %lu bytes, %lu blocks of %lu bytes, %s\n\n", 
+                LEDGER_FILENAME, (unsigned long)ledgerSize(), 
+                (unsigned long)SO_REGISTRY_SIZE, (unsigned long)sizeof(block),
+                LEDGER_LAYOUT_NAME);
+        fprintf(fp_ids, "TRANSACTION POOLS\n");
     } else {
         block_signals(2, SIGINT, SIGTERM);
-        initReadFromShm(semNodes);
-        for(i = 0; i < conf[SO_NODES_NUM]; i++){
-            fprintf(fp_ids, "\tmsgQueue key(%d): %x\n", i, 
-                    ftok(FTOK_PATHNAME_NODE, shmNodesArray[i].pid));
+        initReadFromShm(lockNodes);
+        for(i = 0; i < *nodes_num; i++){
+            fprintf(fp_ids, "\ttransPool(%d): node %d, %lu slots\n", i, 
+                    shmNodesArray[i].pid, conf[SO_TP_SIZE]);
         }
-        endReadFromShm(semNodes);
+        fprintf(fp_ids, "\ttransPool(%lu): master, %lu slots\n", 
+                conf[SO_MAX_NODES], conf[SO_TP_SIZE]);
+        endReadFromShm(lockNodes);
         unblock_signals(2, SIGINT, SIGTERM);
     }
 
@@ -378,12 +446,9 @@ void init_sighandlers()
 /* Reads the environment variables for the configuration  */
 void get_configuration(unsigned long * conf)
 {
-    /* used to read env variables */
-	char *env_var_val = NULL;
-    /* used to detect errors when converting str to ulong */
-	char *chk_strtol_err = NULL;
-	char i = 0;
 #ifdef DEBUG
+	char i = 0;
+
 	MSG_INFO2("Checking compile time parameters...");
 #endif
 	/* Check compile time parameters */
@@ -408,43 +473,9 @@ void get_configuration(unsigned long * conf)
 	printf("|                   RUNNING TIME                  |\n");
 	printf("---------------------------------------------------\n");
 #endif
-	for (i = SO_USERS_NUM; i < N_RUNTIME_CONF_VALUES; i++) {
-		if(env_var_val = getenv(conf_names[i])){
-			errno = 0;
-			conf[i] = strtoul(env_var_val, &chk_strtol_err, 10);
-			/* check conversion */
-			if((conf[i] == 0 && (errno == EINVAL || errno == ERANGE)) 
-                || env_var_val == chk_strtol_err) {
-				fprintf(stderr, "[%sERROR%s] Could not convert env variable %s to an unsigned long\n",
-						COLOR_RED, COLOR_FLUSH, conf_names[i]);
-				shutdown(EXIT_FAILURE);
-			}
-			/* check valid number */
-			if(i == SO_MAX_TRANS_GEN_NSEC && conf[SO_MAX_TRANS_GEN_NSEC] 
-                < conf[SO_MIN_TRANS_GEN_NSEC]) {
-				MSG_ERR("SO_MAX_TRANS_GEN_NSEC is lower than SO_MIN_TRANS_GEN_NSEC!");
-				shutdown(EXIT_FAILURE);
-			} else if(i == SO_MAX_TRANS_PROC_NSEC 
-                        && conf[SO_MAX_TRANS_PROC_NSEC] 
-                        < conf[SO_MIN_TRANS_PROC_NSEC]) {
-				MSG_ERR("SO_MAX_TRANS_PROC_NSEC is lower than SO_MIN_TRANS_PROC_NSEC!");
-				shutdown(EXIT_FAILURE);
-			} else if(i == SO_TP_SIZE && conf[SO_TP_SIZE] <= SO_BLOCK_SIZE) {
-				MSG_ERR("SO_TP_SIZE is not bigger than SO_BLOCK_SIZE!");
-				shutdown(EXIT_FAILURE);
-			} else if(i == SO_REWARD && (conf[SO_REWARD] < 0 
-                        || conf[SO_REWARD] > 100)) {
-				MSG_ERR("SO_REWARD is out range [0-100]!");
-				shutdown(EXIT_FAILURE);
-			}
-		} else {
-			fprintf(stderr, 
-                    "[%sERROR%s] Undefined environment variable %s. Make sure to load env. variables first!\n"
-                    "        Example: source cfg/custom.cfg\n",
-                    COLOR_RED, COLOR_FLUSH, conf_names[i]);
-			shutdown(EXIT_FAILURE);
-		}
-	}
+	/* Reads and checks the env. variables */
+	if(readConfiguration(conf) == -1)
+		shutdown(EXIT_FAILURE);
 #ifdef DEBUG
 	i = SO_USERS_NUM;
 	printf("|    SO_USERS_NUM              |    %10u    |\n", conf[i++]);
@@ -459,7 +490,15 @@ void get_configuration(unsigned long * conf)
 	printf("|    SO_MAX_TRANS_PROC_NSEC    |    %10u    |\n", conf[i++]);
 	printf("|    SO_SIM_SEC                |    %10u    |\n", conf[i++]);
 	printf("|    SO_FRIENDS_NUM            |    %10u    |\n", conf[i++]);
-	printf("|    SO_HOPS                   |    %10u    |\n", conf[i]);
+	printf("|    SO_HOPS                   |    %10u    |\n", conf[i++]);
+	printf("|    SO_TRANS_BURST            |    %10u    |\n", conf[i++]);
+	printf("|    SO_PRIORITY               |    %10u    |\n", conf[i++]);
+	printf("|    SO_MAX_NODES              |    %10u    |\n", conf[i++]);
+	printf("|    SO_HUGE_PAGES             |    %10u    |\n", conf[i++]);
+	printf("|    SO_PREFAULT               |    %10u    |\n", conf[i++]);
+	printf("|    SO_PLACEMENT              |    %10u    |\n", conf[i++]);
+	printf("|    SO_VIRTUAL_TIME           |    %10u    |\n", conf[i++]);
+	printf("|    SO_SEED                   |    %10lu    |\n", conf[i]);
 	printf("---------------------------------------------------\n");
 	MSG_OK("Running time parameters retrieved successfully!");
 	printf("Press any button to continue...");
@@ -470,125 +509,321 @@ void get_configuration(unsigned long * conf)
 /* Generates user child processes and initializes their shmem data structures */
 void users_generation()
 {
-    pid_t child_pid; /* child_pid is used for the fork */
-    int i=0, j=0, k=0;
-    struct timespec t;
-    t.tv_sec = 1;
-    t.tv_nsec = 0;
+    pid_t child_pid;
+    sigset_t old_mask;
+    int i = 0;
 
     for (i = 0; i < conf[SO_USERS_NUM]; i++)
     {
-        child_pid = fork();
-        switch (child_pid)
-        {
-        case -1:
-            MSG_ERR("master.users_generation(): error while generating users.");
-            perror("\tFork user error ");
-            shutdown(EXIT_FAILURE);
-            break;
-        case 0:
-            /* Child branch */
-
-            /* Shmem write */
-            block_signals(2, SIGINT, SIGTERM);
-            initWriteInShm(semUsers);
-            if (shmUsersArray[i].pid == 0)
-            {
-                shmUsersArray[i].pid = getpid();
-                shmUsersArray[i].budget = conf[SO_BUDGET_INIT];
-                shmUsersArray[i].alive = 1;
-            }
-            endWriteInShm(semUsers);
-            unblock_signals(2, SIGINT, SIGTERM);
-
-            execve("./bin/user", NULL, NULL);
-
-            /* exit(EXIT_SUCCESS); */
-            break;
-        default:
-            /* father branch */
-            /* wait(NULL); */
-            break;
-        }
+        child_pid = spawn_child("./bin/user", "user", i);
+
+        /* 
+         * The user reads its slot only after the barrier, the master 
+         * joins it once all the slots are written
+         */
+        old_mask = block_signals(5, SIGINT, SIGTERM, SIGUSR1, SIGALRM, 
+                                 SIGCHLD);
+        initWriteInShm(lockUsers);
+        seqWriteBegin(&shmUsersArray[i].seq);
+        shmUsersArray[i].pid = child_pid;
+        shmUsersArray[i].budget = conf[SO_BUDGET_INIT];
+        shmUsersArray[i].alive = 1;
+        shmUsersArray[i].redirects = 0;
+        shmUsersArray[i].rejects = 0;
+        seqWriteEnd(&shmUsersArray[i].seq);
+        endWriteInShm(lockUsers);
+        reset_signals(old_mask);
     }
 }
 
 /* Generates node child processes and initializes their shmem data structures */
 void nodes_generation()
 {
-    pid_t child_pid; /* child_pid is used for the fork */
-    int i=0, j=0, k=0;
-    struct msqid_ds msg_params;     /* Used to check system limits */
-	msglen_t msg_max_size_no_root;  /* System max msgqueue size */
-    int test_msgqueue = -1;
-
-	test_msgqueue = msgget(ftok("./bin/master", getpid()),
-                           IPC_CREAT | IPC_EXCL | 0600);
-    if(test_msgqueue == -1){
-        MSG_ERR("master.nodes_generation(): test_msgqueue, error while creating the message queue.");
-        perror("\ttest_msgqueue ");
-        shutdown(EXIT_FAILURE);
+    int i=0;
+
+    for (i = 0; i < conf[SO_NODES_NUM]; i++)
+        spawn_node(i);
+}
+
+/* 
+ * Generates the node at index i of the nodes table. A node spawned at
+ * runtime gets no transactions before nodes_num grows, so it does not
+ * write its slot before the master.
+ */
+void spawn_node(int i)
+{
+    pid_t child_pid;
+    sigset_t old_mask;
+    int j=0;
+
+    /* The node inherits the CPU of the master */
+    place_master(i);
+    child_pid = spawn_child("./bin/node", "node", i);
+    place_master(-1);
+
+    /* 
+     * Shmem write, a handler calling clean_end() would wait for the lock 
+     * held here
+     */
+    old_mask = block_signals(5, SIGINT, SIGTERM, SIGUSR1, SIGALRM, SIGCHLD);
+    initWriteInShm(lockNodes);
+    seqWriteBegin(&shmNodesArray[i].seq);
+    shmNodesArray[i].pid = child_pid;
+    shmNodesArray[i].reward = 0;
+    shmNodesArray[i].unproc_trans = 0;
+    shmNodesArray[i].batches = 0;
+    shmNodesArray[i].batch_trans = 0;
+    shmNodesArray[i].forwarded = 0;
+    shmNodesArray[i].to_master = 0;
+    for(j = 0; j < N_REWARD_BUCKETS; j++){
+        shmNodesArray[i].lat_count[j] = 0;
+        shmNodesArray[i].lat_sum_usec[j] = 0;
+        shmNodesArray[i].lat_max_usec[j] = 0;
     }
+    seqWriteEnd(&shmNodesArray[i].seq);
+    endWriteInShm(lockNodes);
+    reset_signals(old_mask);
+}
 
-    if(msgctl(test_msgqueue, IPC_STAT, &msg_params) == 0){
-	    msg_max_size_no_root = msg_params.msg_qbytes;
-    } else {
-        MSG_ERR("master.nodes_generation(): test_msgqueue, error while getting the system msgqueue settings.");
-        perror("\ttest_msgqueue ");
+/* Writes the IPC IDs in the arguments given to the children */
+void init_spawn_args()
+{
+    int i = 0;
+
+    sprintf(spawn_args[ARG_SEM_SIMULATION], "%d", semSimulation);
+    sprintf(spawn_args[ARG_SHM_ARENA], "%d", shmArena);
+    for(i = 1; i < N_SPAWN_ARGS; i++)
+        spawn_argv[i] = spawn_args[i];
+    spawn_argv[N_SPAWN_ARGS] = NULL;
+}
+
+/* 
+ * Starts path with the slot index and the IPC IDs as arguments. 
+ * posix_spawn() doesn't copy the master's page tables like fork(), the
+ * child starts with no blocked signals and no env. variables.
+ */
+pid_t spawn_child(char *path, char *name, int index)
+{
+    static char *no_env[] = { NULL };
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    pid_t child_pid;
+    int err = 0;
+
+    sprintf(spawn_args[ARG_INDEX], "%d", index);
+    spawn_argv[0] = name;
+
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    err = posix_spawn(&child_pid, path, NULL, &attr, spawn_argv, no_env);
+    posix_spawnattr_destroy(&attr);
+    if(err != 0){
+        fprintf(stderr, "[%sERROR%s] master.spawn_child(): error while spawning %s: %s\n",
+                COLOR_RED, COLOR_FLUSH, path, strerror(err));
         shutdown(EXIT_FAILURE);
     }
+    return child_pid;
+}
 
-	if((sizeof(msgbuf) * conf[SO_TP_SIZE]) > msg_max_size_no_root){
-		MSG_ERR("master.nodes_generation(): msg_queue_size, the transaction "
-                "pool is bigger than the maximum msgqueue size.");
-		MSG_INFO2("\tYou should change the MSGMNB kernel info with root privileges.");
-        msgctl(test_msgqueue, IPC_RMID, NULL);
-		shutdown(EXIT_FAILURE);
-	} 
-    msgctl(test_msgqueue, IPC_RMID, NULL);
-
-    for (i = 0; i < conf[SO_NODES_NUM]; i++){
-        child_pid = fork();
-        switch (child_pid){
-        case -1:
-            MSG_ERR("master.nodes_generation(): error while generating nodes.");
-            perror("\tFork node error ");
+/* 
+ * The master joins the barrier after writing all the slots, the time 
+ * from the first spawn is the startup time
+ */
+void wait_barrier()
+{
+    struct sembuf s;
+    struct timespec now;
+    s.sem_num = 0;
+    s.sem_op = 0;
+    s.sem_flg = 0;
+
+    reserveSem(semSimulation, 0);
+    while(semop(semSimulation, &s, 1) == -1){
+        /* Interrupted by a SIGCHLD */
+        if(errno != EINTR){
+            MSG_ERR("master.wait_barrier(): error while waiting for zero on semSimulation.");
+            perror("\tsemSimulation ");
             shutdown(EXIT_FAILURE);
-            break;
-        case 0:
-            /* child branch */
-            child_pid = getpid();
-
-            /* Shmem write */
-            block_signals(2, SIGINT, SIGTERM);
-            initWriteInShm(semNodes);
-            if (shmNodesArray[i].pid == 0)
-            {
-                shmNodesArray[i].pid = child_pid;
-                shmNodesArray[i].reward = 0;
-                shmNodesArray[i].unproc_trans = 0;
-            }
-            endWriteInShm(semNodes);
-            unblock_signals(2, SIGINT, SIGTERM);
-
-            msgTransactions[i] = msgget(ftok(FTOK_PATHNAME_NODE, child_pid), 
-                                        IPC_CREAT | IPC_EXCL | 0600);
-            if(msgTransactions[i] == -1){
-                MSG_ERR("master.nodes_generation(): msgTransactions, error while creating the message queue.");
-                perror("\tmsgTransactions ");
-                shutdown(EXIT_FAILURE);
-            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    startup_msec = (now.tv_sec - startup_begin.tv_sec) * 1e3 
+                   + (now.tv_nsec - startup_begin.tv_nsec) / 1e6;
+}
+
+/* 
+ * With SO_PLACEMENT the nodes get dedicated CPUs, the lowest ones the
+ * master can use, and the users share the others with the master. 
+ * posix_spawn() has no affinity attribute: the children inherit the
+ * affinity of the master, see place_master().
+ */
+void init_placement()
+{
+    cpu_set_t allowed;
+    char node_list[96];
+    char users_list[96];
+    int n_allowed = 0;
+    int i = 0;
 
-            /* execve() dei nodi */ 
-            execve("./bin/node", NULL, NULL);
+    n_node_cpus = 0;
+    numa_node = -1;
+    numa_nodes = 0;
+    strcpy(placement_info, "none");
+    if(!conf[SO_PLACEMENT])
+        return;
+
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1){
+        MSG_WARNING("master.init(): can't read the CPUs of the master, no placement applied.");
+        perror("\tsched_getaffinity");
+        return;
+    }
+    n_allowed = CPU_COUNT(&allowed);
+    if(n_allowed < 2){
+        MSG_WARNING("master.init(): SO_PLACEMENT needs at least 2 CPUs, no placement applied.");
+        strcpy(placement_info, "none, a single CPU");
+        return;
+    }
 
-            /* exit(EXIT_SUCCESS); */
-            break;
-        default:
-            /* father branch */
-            break;
+    /* At least a CPU is left to the users */
+    CPU_ZERO(&users_cpus);
+    for(i = 0; i < CPU_SETSIZE; i++){
+        if(!CPU_ISSET(i, &allowed))
+            continue;
+        if(n_node_cpus < conf[SO_MAX_NODES] && n_node_cpus < n_allowed - 1)
+            node_cpus[n_node_cpus++] = i;
+        else
+            CPU_SET(i, &users_cpus);
+    }
+    numa_node = cpu_numa_node(node_cpus[0]);
+    place_master(-1);
+
+    CPU_ZERO(&allowed);
+    for(i = 0; i < n_node_cpus; i++)
+        CPU_SET(node_cpus[i], &allowed);
+    cpus_to_string(&allowed, node_list, sizeof(node_list));
+    cpus_to_string(&users_cpus, users_list, sizeof(users_list));
+    sprintf(placement_info, "nodes on CPUs %s, users and master on CPUs %s",
+            node_list, users_list);
+    if(numa_nodes > 1)
+        sprintf(placement_info + strlen(placement_info), 
+                ", arena on NUMA node %d", numa_node);
+    printf("[INFO] Placement: %s\n", placement_info);
+}
+
+/* 
+ * Sets the affinity of the master, the next spawned child inherits it: 
+ * the CPU of the node at node_index or, with -1, the users' CPUs
+ */
+void place_master(int node_index)
+{
+    cpu_set_t set;
+
+    if(n_node_cpus == 0)
+        return;
+    if(node_index < 0){
+        set = users_cpus;
+    } else {
+        CPU_ZERO(&set);
+        CPU_SET(node_cpus[node_index % n_node_cpus], &set);
+    }
+    if(sched_setaffinity(0, sizeof(set), &set) == -1){
+        MSG_WARNING("master.place_master(): error while setting the affinity.");
+        perror("\tsched_setaffinity");
+    }
+}
+
+/* NUMA node of cpu from sysfs, counts the NUMA nodes in numa_nodes */
+int cpu_numa_node(int cpu)
+{
+    char path[64];
+    int found = 0;
+    int i = 0;
+
+    for(i = 0; i < MAX_NUMA_NODES; i++){
+        sprintf(path, "/sys/devices/system/node/node%d", i);
+        if(access(path, F_OK) == -1)
+            continue;
+        numa_nodes++;
+        sprintf(path, "/sys/devices/system/node/node%d/cpu%d", i, cpu);
+        if(access(path, F_OK) == 0)
+            found = i;
+    }
+    return found;
+}
+
+/* The arena pages are allocated on the NUMA node of the nodes' CPUs */
+void bind_arena(size_t size)
+{
+    unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    int bits = 8 * sizeof(unsigned long);
+
+    memset(mask, 0, sizeof(mask));
+    mask[numa_node / bits] |= 1UL << (numa_node % bits);
+    if(syscall(SYS_mbind, arena, size, MPOL_PREFERRED, mask, 
+               MAX_NUMA_NODES + 1, 0) == -1){
+        MSG_WARNING("master.init(): can't bind the arena to the NUMA node of the nodes.");
+        perror("\tmbind");
+    }
+}
+
+/* Writes the CPUs of set as a list of ranges, "0-3,6" */
+void cpus_to_string(cpu_set_t *set, char *buf, int len)
+{
+    char range[24];
+    int first = -1;
+    int i = 0;
+
+    buf[0] = '\0';
+    for(i = 0; i <= CPU_SETSIZE; i++){
+        if(i < CPU_SETSIZE && CPU_ISSET(i, set)){
+            if(first == -1)
+                first = i;
+            continue;
         }
+        if(first == -1)
+            continue;
+        if(first == i - 1)
+            sprintf(range, "%s%d", buf[0] ? "," : "", first);
+        else
+            sprintf(range, "%s%d-%d", buf[0] ? "," : "", first, i - 1);
+        if((int)(strlen(buf) + strlen(range)) + 4 >= len){
+            strcat(buf, ",..");
+            return;
+        }
+        strcat(buf, range);
+        first = -1;
+    }
+}
+
+/* 
+ * The blocks are written in the export as they are published. The writer
+ * thread starts with all the signals blocked, so the handlers always run
+ * in the main thread.
+ */
+void start_export_writer()
+{
+    sigset_t all;
+    sigset_t old_mask;
+    int err = 0;
+
+    if(exportOpen(&blockExport, EXPORT_FILENAME, EXPORT_PART_FILENAME) == -1){
+        MSG_ERR("master.init(): error while creating the blockchain export.");
+        perror("\t" EXPORT_PART_FILENAME);
+        shutdown(EXIT_FAILURE);
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old_mask);
+    err = pthread_create(&exportThread, NULL, export_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if(err != 0){
+        fprintf(stderr, "[%sERROR%s] master.init(): error while creating the export writer: %s\n",
+                COLOR_RED, COLOR_FLUSH, strerror(err));
+        shutdown(EXIT_FAILURE);
     }
+    export_started = 1;
 }
 
 #pragma endregion /* INITIALIZATION */
@@ -600,168 +835,177 @@ void nodes_generation()
 /* Prints the useful stats in lifetime, Prints all the info before exit() */
 void print_stats(int force_print)
 {
-    int i = 0, j = 0;
     int cond = (users_generated && nodes_generated);
-    FILE *fp;
+    struct timespec begin;
+    struct timespec end;
     
     if(force_print && cond){
-        print_all_users();
-        print_all_nodes();
+        wait_nodes_exit();
+        ledgerSync(ledger);
+
+        /* Only the blocks published after the last export are left */
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        stop_export_writer();
+        if(exportClose(&blockExport, libroMastroArray, *block_number) == -1){
+            MSG_ERR("master.print_stats(): error while writing " EXPORT_FILENAME ".");
+            perror("\texport ");
+            fprintf(stderr, "\tthe blocks are kept in " EXPORT_PART_FILENAME "\n");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        export_msec = (end.tv_sec - begin.tv_sec) * 1e3 
+                      + (end.tv_nsec - begin.tv_nsec) / 1e6;
+
+        printAllUsers(shmUsersArray, balancesArray, conf);
+        printAllNodes(shmNodesArray, *nodes_num, 1);
         printf("Users died too early: [%d/%d]\n", 
                early_deaths, conf[SO_USERS_NUM]);
 
-        initReadFromShm(semBlockNumber);
         printf("# of blocks: %d\n", *block_number);
-        endReadFromShm(semBlockNumber);
-
-        if(term_reason == 1)
-            printf("Simulation ended: The blockchain is full -> [%d/%ld]\n",
-                   *block_number, SO_REGISTRY_SIZE);
-        else if(term_reason == 2)
-            printf("Simulation ended: The execution lasted SO_SIM_SEC=%ld seconds.\n",
-                   conf[SO_SIM_SEC]);
-        else if(term_reason == 3)
-            printf("Simulation ended: No more active users.\n");
-        else if(term_reason == 4)
-            printf("Simulation ended: Interrupt signal received.\n");
-
-        /* Blockchain print to file */
-        fp = fopen("./out/blockchain", "w");
-        initReadFromShm(semLibroMastro);
-        initReadFromShm(semBlockNumber);
-        fprintf(fp, "\n\n===============BLOCKCHAIN==============\n");
-        fprintf(fp, "# of blocks: %d\n", *block_number);
-
-        for(i = 0; i < *block_number; i++){
-            fprintf(fp, "Block #%d:\n", i);
-            for(j = 0; j < SO_BLOCK_SIZE; j++){
-                fprintf(fp, "\tTransaction #%d: t=%d.%d\t snd=%d\t rcv=%d\t qty=%d\t rwd=%d\n",
-                        j, libroMastroArray[i].transBlock[j].timestamp.tv_sec,
-                        libroMastroArray[i].transBlock[j].timestamp.tv_nsec,
-                        libroMastroArray[i].transBlock[j].sender,
-                        libroMastroArray[i].transBlock[j].receiver,
-                        libroMastroArray[i].transBlock[j].quantity,
-                        libroMastroArray[i].transBlock[j].reward);
-            }
-        }
-        endReadFromShm(semBlockNumber);
-        endReadFromShm(semLibroMastro);
-        fclose(fp);
+        printf("Startup time: %.3f ms for %lu users and %lu nodes\n", 
+               startup_msec, conf[SO_USERS_NUM], conf[SO_NODES_NUM]);
+        printf("Placement: %s\n", placement_info);
+        printf("Seed: %lu\n", conf[SO_SEED]);
+        printf("Libro Mastro: %s, checksum %08x, %s layout\n", 
+               LEDGER_FILENAME, ledger->checksum, LEDGER_LAYOUT_NAME);
+        printf("Blockchain export: %.3f ms at the end\n", export_msec);
+        if(spawned > 0)
+            printf("Nodes spawned at runtime: %d\n", spawned);
+
+        /* The shutdown after sim_end is not simulation time */
+        printBlockRate(*block_number, &sim_start, &sim_end);
+        printBatchFill(shmNodesArray, *nodes_num);
+        printPushStats(shmUsersArray, conf);
+        print_forward_stats();
+        printCommitLatency(shmNodesArray, *nodes_num, conf[SO_PRIORITY]);
+        printEndReason(term_reason, *block_number, conf);
     }
     else if(cond){
-        printf("\n\n===============ACTIVE==============\n");
-        printf("\tActive users: [%d/%d]\n", remaining_users, 
-               conf[SO_USERS_NUM]);
-        printf("\tActive nodes: [%d/%d]\n\n", remaining_nodes, 
-               conf[SO_NODES_NUM]);
-
-        if(conf[SO_USERS_NUM] < 6){
-            print_all_users();
-        } else {
-            print_most_relevant_users();
-        }
+        printActiveStats(shmUsersArray, balancesArray, remaining_users,
+                         shmNodesArray, *nodes_num, remaining_nodes, conf);
+    }
+}
 
-        if(conf[SO_NODES_NUM] < 6){
-            print_all_nodes();
-        } else {
-            print_most_relevant_nodes();
+/* 
+ * Moves the transactions forwarded more than SO_HOPS times to the node
+ * with the emptiest pool, returns 0 if some are left because the pool
+ * was full
+ */
+int place_transactions()
+{
+    transaction trans;
+    int hops = 0;
+    int i = 0;
+    int best = 0;
+    unsigned long count = 0;
+    unsigned long min = 0;
+
+    while(tpPeek(masterPool, &trans, NULL, 1) == 1){
+        min = ULONG_MAX;
+        for(i = 0; i < *nodes_num; i++){
+            count = tpCount(tpGet(poolsArray, i, conf[SO_TP_SIZE]));
+            if(count < min){
+                min = count;
+                best = i;
+            }
         }
+        if(tpPush(tpGet(poolsArray, best, conf[SO_TP_SIZE]), 
+                  &trans, 1, &hops) < 0)
+            return 0;
+        tpDrop(masterPool, 1);
+        placed++;
     }
+    return 1;
 }
 
-/* Prints all users' info */
-void print_all_users()
+/* 
+ * Spawns a new node when the pools stay saturated, until SO_MAX_NODES.
+ * The node's table slot and pool already exist, the users see the node
+ * once nodes_num grows.
+ */
+void check_saturation()
 {
     int i = 0;
+    unsigned long waiting = 0;
 
-    initReadFromShm(semUsers);
-    printf("\n\n===============USERS==============\n");
-    for(i = 0; i < conf[SO_USERS_NUM]; i++){
-        printf("\tPID: %d\n", shmUsersArray[i].pid);
-        printf("\tBudget: %d\n\n", shmUsersArray[i].budget);
+    if(*nodes_num >= conf[SO_MAX_NODES] || is_terminating)
+        return;
+
+    for(i = 0; i < *nodes_num; i++)
+        waiting += tpCount(tpGet(poolsArray, i, conf[SO_TP_SIZE]));
+
+    if(waiting * 100 > SPAWN_OCCUPANCY * conf[SO_TP_SIZE] * *nodes_num)
+        saturated++;
+    else
+        saturated = 0;
+
+    if(saturated >= SPAWN_CHECKS){
+        saturated = 0;
+        spawn_node(*nodes_num);
+        remaining_nodes++;
+        spawned++;
+        __sync_fetch_and_add(nodes_num, 1);
     }
-    endReadFromShm(semUsers);
 }
 
-/* Prints the richest and poorest users */
-void print_most_relevant_users()
+/* 
+ * Waits for the nodes to exit after the SIGINT: a node processing a block
+ * reserves a slot and commits it before handling the signal, the balances
+ * must not change while they are printed
+ */
+void wait_nodes_exit()
 {
     int i = 0;
-    pid_t pid_min;
-    pid_t pid_max;
-    int min = INT_MAX;
-    int max = INT_MIN;
-
-    initReadFromShm(semUsers);
-    printf("\n\n===============RICHEST & POOREST USERS==============\n");
-    for(i = 0; i < conf[SO_USERS_NUM]; i++){
-        if(shmUsersArray[i].budget < min){
-            min = shmUsersArray[i].budget;
-            pid_min = shmUsersArray[i].pid;
-        }
-        if(shmUsersArray[i].budget > max){
-            max = shmUsersArray[i].budget;
-            pid_max = shmUsersArray[i].pid;
-        }
-    }
-    endReadFromShm(semUsers);
+    node n;
 
-    printf("Poorest:\n");
-    printf("\tPID: %d\n", pid_min);
-    printf("\tBudget: %d\n\n", min);
-    printf("Richest:\n");
-    printf("\tPID: %d\n", pid_max);
-    printf("\tBudget: %d\n\n", max);
+    for(i = 0; i < *nodes_num; i++){
+        seqReadCopy(&shmNodesArray[i].seq, &n, &shmNodesArray[i], sizeof(n));
+        while(waitpid(n.pid, NULL, 0) == -1 && errno == EINTR)
+            ;
+    }
 }
 
-/* Prints all nodes' info */
-void print_all_nodes()
+/* Writer thread: appends the published blocks to the export */
+void *export_writer(void *arg)
 {
-    int i = 0;
+    struct timespec t;
 
-    initReadFromShm(semNodes);
-    printf("\n\n===============NODES==============\n");
-    for(i = 0; i < conf[SO_NODES_NUM]; i++){
-        printf("\tPID: %d\n", shmNodesArray[i].pid);
-        printf("\tReward: %d\n", shmNodesArray[i].reward);
-        if(is_terminating)
-            printf("\tUnprocessed transactions: %d\n\n", 
-                   shmNodesArray[i].unproc_trans);
-        else
-            printf("\n");
+    while(!export_stop){
+        exportBlocks(&blockExport, libroMastroArray, 
+                     *(volatile unsigned int *)block_number);
+        t.tv_sec = 0;
+        t.tv_nsec = EXPORT_PERIOD_NSEC;
+        futexWait(&export_stop, 0, &t);
     }
-    endReadFromShm(semNodes);
+    return NULL;
+}
+
+/* Waits for the writer, then the master can close the export */
+void stop_export_writer()
+{
+    if(!export_started)
+        return;
+    export_stop = 1;
+    futexWake(&export_stop, 1);
+    pthread_join(exportThread, NULL);
+    export_started = 0;
 }
 
-/* Prints the richest and poorest nodes */
-void print_most_relevant_nodes()
+/* Prints how many transactions moved between the pools */
+void print_forward_stats()
 {
     int i = 0;
-    pid_t pid_min;
-    pid_t pid_max;
-    int min = INT_MAX;
-    int max = INT_MIN;
-
-    initReadFromShm(semNodes);
-    printf("\n\n===============RICHEST & POOREST NODES==============\n");
-    for(i = 0; i < conf[SO_NODES_NUM]; i++){
-        if(shmNodesArray[i].reward < min){
-            min = shmNodesArray[i].reward;
-            pid_min = shmNodesArray[i].pid;
-        }
-        if(shmNodesArray[i].reward > max){
-            max = shmNodesArray[i].reward;
-            pid_max = shmNodesArray[i].pid;
-        }
+    node n;
+    unsigned long forwarded = 0;
+    unsigned long to_master = 0;
+
+    for(i = 0; i < *nodes_num; i++){
+        seqReadCopy(&shmNodesArray[i].seq, &n, &shmNodesArray[i], sizeof(n));
+        forwarded += n.forwarded;
+        to_master += n.to_master;
     }
-    endReadFromShm(semNodes);
-
-    printf("Poorest:\n");
-    printf("\tPID: %d\n", pid_min);
-    printf("\tReward: %d\n\n", min);
-    printf("Richest:\n");
-    printf("\tPID: %d\n", pid_max);
-    printf("\tReward: %d\n\n", max);
+    printf("Forwarded transactions: %lu to friends, %lu to the master "
+           "(%lu placed, %lu waiting)\n", forwarded, to_master, placed, 
+           tpCount(masterPool));
 }
 
 /* -------------------- SIGNAL HANDLERS -------------------- */
@@ -831,7 +1075,7 @@ void send_kill_signals()
 
     /* For each PID in Users array, send signal */
     if(users_generated){
-        initReadFromShm(semUsers);
+        initReadFromShm(lockUsers);
         for(i = 0; i < conf[SO_USERS_NUM]; i++) {
             /* if the User is still alive, send the SIGINT signal */
             if(!kill(shmUsersArray[i].pid, 0)) {
@@ -841,13 +1085,13 @@ void send_kill_signals()
                 kill(shmUsersArray[i].pid, SIGINT);
             }
         }
-        endReadFromShm(semUsers);
+        endReadFromShm(lockUsers);
     }
 
     /* For each PID in Nodes array, send signal */
     if(nodes_generated){
-        initReadFromShm(semNodes);
-        for(i = 0; i < conf[SO_NODES_NUM]; i++) {
+        initReadFromShm(lockNodes);
+        for(i = 0; i < *nodes_num; i++) {
             /* if the Node is still alive, send the SIGINT signal */
             if(!kill(shmNodesArray[i].pid, 0)) {
 #ifdef DEBUG
@@ -856,70 +1100,35 @@ void send_kill_signals()
                 kill(shmNodesArray[i].pid, SIGINT);
             }
         }
-        endReadFromShm(semNodes);
+        endReadFromShm(lockNodes);
     }
 }
 
 /* Clears all IPC objects, Memory free, exit */
 void shutdown(int status) 
 {
-    int i = 0;
-
-    /* detach the shmem for the last block number */
-    if(shmBlockNumber != -1 && shmdt((void *)block_number) == -1){
-        MSG_ERR("master.shutdown(): block_number, error while detaching "
-                "the block_number shmem segment.");
-        perror("\tblock_number shmdt ");
-	}
-
-    /* detach the shmem for the shmUsersArray */
-    if(shmUsers != -1 && shmdt((void *)shmUsersArray) == -1){
-        MSG_ERR("master.shutdown(): shmUsersArray, error while detaching "
-                "the shmUsersArray shmem segment.");
-        perror("\tshmUsersArray shmdt ");
-	}
-
-    /* detach the shmem for the shmNodesArray */
-    if(shmNodes != -1 && shmdt((void *)shmNodesArray) == -1){
-        MSG_ERR("master.shutdown(): shmNodesArray, error while detaching "
-                "the shmNodesArray shmem segment.");
-        perror("\tshmNodesArray shmdt ");
-	}
-
-    /* detach the shmem for the Libro Mastro */
-    if(shmLibroMastro != -1 && shmdt((void *)libroMastroArray) == -1){
-        MSG_ERR("master.shutdown(): libroMastroArray, error while detaching "
-                "the libroMastroArray shmem segment.");
-        perror("\tlibroMastroArray shmdt ");
+    /* detach the shmem arena */
+    if(arena != NULL && shmdt((void *)arena) == -1){
+        MSG_ERR("master.shutdown(): arena, error while detaching "
+                "the arena shmem segment.");
+        perror("\tarena shmdt ");
 	}
 
 	/* Removing shmem segments */
-	shmctl(shmUsers, IPC_RMID, NULL);
-	shmctl(shmNodes, IPC_RMID, NULL);
-    shmctl(shmLibroMastro, IPC_RMID, NULL);
-    shmctl(shmBlockNumber, IPC_RMID, NULL);
+	shmctl(shmArena, IPC_RMID, NULL);
 
-	/* Removing semaphores */
-	semctl(semUsers, 0, IPC_RMID, 0);
-    semctl(semNodes, 0, IPC_RMID, 0);
-    semctl(semLibroMastro, 0, IPC_RMID, 0);
-    semctl(semSimulation, 0, IPC_RMID, 0);
-    semctl(semBlockNumber, 0, IPC_RMID, 0);
-
-    /* Removing Msg Queues */
-    if(nodes_generated){
-        for(i=0; i < conf[SO_NODES_NUM]; i++)
-            msgctl(msgTransactions[i], IPC_RMID, NULL);
-        free(msgTransactions);
+    stop_export_writer();
+    if(blockExport.fp != NULL){
+        fclose(blockExport.fp);
+        free(blockExport.buffer);
     }
 
-    /* detach the shmem of the conf */
-    if(shmdt((void *)conf) == -1){
-        MSG_ERR("master.shutdown(): conf, error while detaching "
-                "the conf shmem segment.");
-        perror("\tconf shmdt ");
-	}
-    shmctl(shmConfig, IPC_RMID, NULL);
+    /* The Libro Mastro file stays in out/ */
+    if(ledger != NULL)
+        ledgerUnmap(ledger);
+
+	/* Removing semaphores */
+	semctl(semSimulation, 0, IPC_RMID, 0);
 
     exit(status);
 }
@@ -928,6 +1137,7 @@ void shutdown(int status)
     removes IPC Object and terminates the master process */
 void clean_end()
 {
+    clock_gettime(CLOCK_MONOTONIC, &sim_end);
     send_kill_signals();
 
     print_stats(FORCE_PRINT_STATS);
@@ -1,5 +1,4 @@
 #define _GNU_SOURCE
-#include <errno.h>
 #include <time.h>
 #include <signal.h> /* SIG* */
 #include "common.h"
@@ -8,11 +7,21 @@
 /* -------------------- PROTOTYPES -------------------- */
 
 /* Initialization */
-void init();
-void init_conf();
+void init(int argc, char **argv);
+void read_args(int argc, char **argv);
 void init_sharedmem();
-void init_semaphores();
-void init_msgqueue();
+void init_users_index();
+void init_friends();
+int cmp_user_index(const void *a, const void *b);
+
+/* Lifetime */
+int get_user_index(int id);
+void forward_transactions();
+int fill_block(transaction *trans);
+int fill_block_priority(transaction *trans);
+int higher_priority(transaction *a, transaction *b);
+void pending_push(transaction *trans);
+transaction pending_pop();
 
 /* Signal Handlers */
 void sigint_handler();
@@ -23,130 +32,142 @@ void shutdown(int status);
 /* -------------------- GLOBAL VARIABLES -------------------- */
 
 /**** SHARED MEMORY IDs ****/
-int shmConfig;        /* ID shmem configuration */
-int shmNodes;         /* ID shmem nodes data */
-int shmLibroMastro;   /* ID shmem Libro Mastro */
-int shmBlockNumber;   /* ID shmem libro mastro block number */
+int shmArena;         /* ID shmem arena, all the shared data */
 
 /**** SHARED MEMORY ATTACHED VARIABLES ****/
+arena_header *arena;          /* Shmem arena, the regions follow */
 node *shmNodesArray;          /* Shmem Array of Node PIDs */
-block *libroMastroArray;      /* Shmem Array of blocks */
-unsigned int *block_number;   /* Shmem number of the last block */
+ledger_header *ledger;        /* Libro Mastro file, the blocks follow */
 unsigned long *conf;          /* Shmem Array of configuration values */
-
-/**** MESSAGE QUEUE ID ****/
-int myTransactionsMsg;  /* ID for the message queue */
+user *shmUsersArray;          /* Shmem Array of User PIDs */
+account *balancesArray;       /* Shmem Array of committed balances */
+shm_rwlock *locksArray;       /* Shmem Array of readers/writers locks */
+void *poolsArray;             /* Shmem transaction pools of the nodes */
+tpool *myPool;                /* Node's transaction pool */
+tpool *masterPool;            /* Pool of the transactions to place */
+int *nodes_num;               /* Shmem number of nodes in the table */
 
 /**** SEMAPHORE IDs ****/
-int semNodes;        /* Semaphore for shmem access on the Array of Node PIDs */
-int semLibroMastro;  /* Semaphore for shmem access on the Libro Mastro */
-int semBlockNumber;  /* Semaphore for the last block number */
 int semSimulation;   /* Semaphore for the simulation */
 
+/**** LOCKS ****/
+shm_rwlock *lockNodes; /* Lock for shmem access on the Array of Node PIDs */
+shm_rwlock *lockUsers; /* Lock for shmem access on the Array of User PIDs */
+
 /*** Global variables ***/
 int reward_budget;	/* Node's reward */
 int unproc_trans;	/* Number of unprocessed transactions before term. */
 int my_index;		/* Node's index in the shmNodesArray */
 int count;    		/* Transaction number in a block */
+unsigned int batches;		/* Number of non empty reads of the pool */
+unsigned int batch_trans;	/* Transactions read from the pool */
+
+/* Nodes receiving the transactions over the threshold */
+int *friends;
+int friends_num;
+unsigned long forward_threshold;
+unsigned int forwarded;		/* Transactions sent to a friend */
+unsigned int to_master;		/* Transactions sent to the master */
+
+/* Priority mode: transactions read from the pool, max heap on reward */
+transaction *pending;
+int pendingSize;
+
+/* Commit latency of the transactions, grouped by reward */
+unsigned int lat_count[N_REWARD_BUCKETS];
+unsigned long lat_sum_usec[N_REWARD_BUCKETS];
+unsigned long lat_max_usec[N_REWARD_BUCKETS];
 pid_t my_pid;
 
-int main()
+/* Users sorted by PID, used to find the account of a transaction */
+struct user_index {
+	pid_t pid;
+	int index;
+} *usersIndex;
+
+int main(int argc, char **argv)
 {
-	msgbuf msg;
 	transaction reward;
 	struct timespec timestamp;
 	struct timespec t;
-	block transSet;
+	transaction transSet[SO_BLOCK_SIZE];
+	block *b;
+	int last = 0;
 
-	ssize_t num_bytes;
-	int count = 0;
 	int i = 0;
 	int sum_rewards = 0;
+	int filled = 0;
 
-	init();
+	init(argc, argv);
 #ifdef DEBUG
-	printf("[INFO] node.main(%d): MSG_QUEUE Waiting for messages...\n", my_pid);
+	printf("[INFO] node.main(%d): Waiting for transactions...\n", my_pid);
 #endif
+	count = 0;
 	while(1){
-		num_bytes = 0;
-		num_bytes = msgrcv(myTransactionsMsg, &msg, sizeof(msg), 0, 0);
-
-		if (num_bytes > 0) {
-			/* received a good message */
-			/* adding the transaction to a local block */
-			transSet.transBlock[count] = msg.trans;
-			count++;
-
-			if(count == SO_BLOCK_SIZE-1){
-				/* adding the reward transaction */
-				sum_rewards = 0;
-				for(i = 0; i <= count; i++){
-					sum_rewards += transSet.transBlock[i].reward;
-				}
-				reward_budget += sum_rewards;
-				clock_gettime(CLOCK_REALTIME, &timestamp);
-
-				reward.timestamp = timestamp;
-				reward.sender = TRANS_REWARD_SENDER;
-				reward.receiver = my_pid;
-				reward.quantity = sum_rewards;
-				reward.reward = 0;
-				
-				transSet.transBlock[count] = reward;
-
-				block_signals(2, SIGINT, SIGTERM);
-				/* Use the current block_number value and increment it */
-				initWriteInShm(semBlockNumber);
-				transSet.block_number = *block_number;
-				/* Not releasing the semaphore yet, I use the block_number
-					as index for the libro mastro's array of blocks */
-
-				/* processing */
-				t.tv_sec = 0;
-				t.tv_nsec = randomNum(conf[SO_MIN_TRANS_PROC_NSEC], 
-									  conf[SO_MAX_TRANS_GEN_NSEC]);
-				nanosleep(&t, &t);
-
-				/* libro mastro is full */
-				if(*block_number == SO_REGISTRY_SIZE){
-					/* send signal to master process */
-					unblock_signals(2, SIGINT, SIGTERM);
-					endWriteInShm(semBlockNumber);
+		forward_transactions();
+		if(conf[SO_PRIORITY])
+			filled = fill_block_priority(transSet);
+		else
+			filled = fill_block(transSet);
+
+		if(filled){
+			/* adding the reward transaction */
+			sum_rewards = 0;
+			for(i = 0; i <= count; i++){
+				sum_rewards += transSet[i].reward;
+			}
+			clock_gettime(CLOCK_REALTIME, &timestamp);
+
+			reward.timestamp = timestamp;
+			reward.sender = TRANS_REWARD_SENDER;
+			reward.receiver = my_pid;
+			reward.quantity = sum_rewards;
+			reward.reward = 0;
+			
+			transSet[count] = reward;
+
+			block_signals(2, SIGINT, SIGTERM);
+			/* 
+			 * processing, the other nodes process their blocks 
+			 * at the same time and only the commit is ordered
+			 */
+			t.tv_sec = 0;
+			t.tv_nsec = randomNum(conf[SO_MIN_TRANS_PROC_NSEC], 
+								  conf[SO_MAX_TRANS_PROC_NSEC]);
+			nanosleep(&t, &t);
+
+			b = ledgerCommit(ledger, transSet, balancesArray, get_user_index,
+							 &reward_budget, &last);
+
+			/* libro mastro is full, the master is going to end */
+			if(b == NULL){
+				unblock_signals(2, SIGINT, SIGTERM);
+				pause();
+			} else {
+				/* The node that publishes the last block tells the master */
+				if(last)
 					kill(getppid(), SIGUSR1);
-					pause();
-				} else {
-					initWriteInShm(semLibroMastro);
-					libroMastroArray[*block_number] = transSet;
-					endWriteInShm(semLibroMastro);
-
-					*block_number = *block_number + 1;
-				}
-				endWriteInShm(semBlockNumber);
-
-				initWriteInShm(semNodes);
-				shmNodesArray[my_index].reward = reward_budget;
-				endWriteInShm(semNodes);
-
-				/* we can start writing another block */
-				count = 0;
+				clock_gettime(CLOCK_REALTIME, &t);
+				blockLatencies(b, &t, lat_count, lat_sum_usec, lat_max_usec);
+			}
 
-				unblock_signals(2, SIGINT, SIGTERM);
+			seqWriteBegin(&shmNodesArray[my_index].seq);
+			shmNodesArray[my_index].reward = reward_budget;
+			shmNodesArray[my_index].batches = batches;
+			shmNodesArray[my_index].batch_trans = batch_trans;
+			shmNodesArray[my_index].forwarded = forwarded;
+			shmNodesArray[my_index].to_master = to_master;
+			for(i = 0; i < N_REWARD_BUCKETS; i++){
+				shmNodesArray[my_index].lat_count[i] = lat_count[i];
+				shmNodesArray[my_index].lat_sum_usec[i] = lat_sum_usec[i];
+				shmNodesArray[my_index].lat_max_usec[i] = lat_max_usec[i];
 			}
-		}
+			seqWriteEnd(&shmNodesArray[my_index].seq);
 
-		/* Error handling */
-		if (errno == EINTR) {
-			fprintf(stderr, 
-					"node.main(%d): interrupted by a signal while waiting for a message "
-					"on Q_ID=%d. Trying again...\n",
-					my_pid, myTransactionsMsg);
-			continue;
-		}
-		if (errno == EIDRM) {
-			fprintf(stderr, "node.main(%d): The Q_ID=%d was removed. Ending!\n", 
-					my_pid,
-					myTransactionsMsg);
-			shutdown(EXIT_FAILURE);
+			/* we can start writing another block */
+			count = 0;
+
+			unblock_signals(2, SIGINT, SIGTERM);
 		}
 	}
 	
@@ -156,7 +177,7 @@ int main()
 /* -------------------- INITIALIZATION FUNCTIONS -------------------- */
 
 /* Accessing all the IPC objects, setting the SIGINT Handler */
-void init()
+void init(int argc, char **argv)
 {
 	int i = 0;
 	struct sembuf s;
@@ -167,137 +188,354 @@ void init()
 	my_pid = getpid();
 	reward_budget = 0;
 	unproc_trans = 0;
+	batches = 0;
+	batch_trans = 0;
+	pending = NULL;
+	pendingSize = 0;
+	friends = NULL;
+	friends_num = 0;
+	forwarded = 0;
+	to_master = 0;
+	for(i = 0; i < N_REWARD_BUCKETS; i++){
+		lat_count[i] = 0;
+		lat_sum_usec[i] = 0;
+		lat_max_usec[i] = 0;
+	}
 
-	init_conf();
+	read_args(argc, argv);
 	init_sharedmem();
-	init_semaphores();
-	init_msgqueue();
 
-	/* Initializes seed for the random number generation */ 
-    srand(time(NULL));
+	/* The random numbers of the node's slot */ 
+	initRandom(conf[SO_SEED], NODE_STREAM(my_index));
 
 	/* Master wants to kill the node */
 	set_handler(SIGINT, sigint_handler);
 
-	block_signals(2, SIGINT, SIGTERM);
-	initReadFromShm(semNodes);
-	i = 0;
-	while(shmNodesArray[i].pid != my_pid)
-		i++;
-	my_index = i;
-	endReadFromShm(semNodes);
-	unblock_signals(2, SIGINT, SIGTERM);
+	myPool = tpGet(poolsArray, my_index, conf[SO_TP_SIZE]);
+	masterPool = tpGet(poolsArray, conf[SO_MAX_NODES], conf[SO_TP_SIZE]);
+	init_friends();
 
-	/* Waiting that the other nodes are ready and active */
-	reserveSem(semSimulation, 0);
-    if(semop(semSimulation, &s, 1) == -1){
+	/* 
+	 * Over this number of waiting transactions the node forwards the 
+	 * others, it keeps at least a block
+	 */
+	forward_threshold = conf[SO_TP_SIZE] * 3 / 4;
+	if(forward_threshold < SO_BLOCK_SIZE - 1)
+		forward_threshold = SO_BLOCK_SIZE - 1;
+
+	if(conf[SO_PRIORITY]){
+		pending = malloc(sizeof(transaction) * conf[SO_TP_SIZE]);
+		if(pending == NULL){
+			MSG_ERR("node.init(): pending, error while allocating memory.");
+			shutdown(EXIT_FAILURE);
+		}
+	}
+
+	/* 
+	 * Waiting that the other nodes are ready and active, a node spawned
+	 * at runtime finds the simulation already started
+	 */
+	if(my_index < conf[SO_NODES_NUM]){
+		reserveSem(semSimulation, 0);
+		if(semop(semSimulation, &s, 1) == -1){
 #ifdef DEBUG
-        MSG_ERR("node.init(): error while waiting for zero on semSimulation.");
-        perror("\tsemSimulation: ");
+			MSG_ERR("node.init(): error while waiting for zero on semSimulation.");
+			perror("\tsemSimulation: ");
 #endif
+		}
 	}
+
+	/* Every user wrote its PID before the simulation started */
+	init_users_index();
 }
 
-/* Accessing the configuration shared memory segment in READ ONLY */
-void init_conf()
+/* Reads the slot index and the IPC IDs given by the master */
+void read_args(int argc, char **argv)
 {
-	shmConfig = shmget( SHM_ENV_KEY, 
-						sizeof(unsigned long) * N_RUNTIME_CONF_VALUES, 
-						SHM_RDONLY);
-	if (shmConfig == -1){
-		MSG_ERR("node.init(): shmConfig, error while getting the shared memory segment.");
-        perror("\tshmConfig ");
-		shutdown(EXIT_FAILURE);
+	if(argc != N_SPAWN_ARGS){
+		MSG_ERR("node.init(): the node must be started by the master.");
+		exit(EXIT_FAILURE);
 	}
-    conf = shmat(shmConfig, NULL, 0);
+	my_index = atoi(argv[ARG_INDEX]);
+	semSimulation = atoi(argv[ARG_SEM_SIMULATION]);
+	shmArena = atoi(argv[ARG_SHM_ARENA]);
 }
 
-/* Accessing the other shared memory segments and attaching */
+
+/* 
+ * Attaching the shmem arena, with SO_PREFAULT all the regions are mapped
+ * before the simulation starts
+ */
 void init_sharedmem()
 {
-    shmNodes = shmget(SHM_NODE_KEY, sizeof(node) * conf[SO_NODES_NUM], 0600);
-	if (shmNodes == -1){
-		MSG_ERR("node.init(): shmNodes, error while creating the shared memory segment.");
-        perror("\tshmNodes ");
-		shutdown(EXIT_FAILURE);
+	int i = 0;
+
+	arena = (arena_header *)shmat(shmArena, NULL, 0);
+	if(arena == (void *) -1){
+		MSG_ERR("node.init(): shmArena, error while attaching the shared memory segment.");
+        perror("\tshmArena ");
+		exit(EXIT_FAILURE);
 	}
-	shmNodesArray = (node *)shmat(shmNodes, NULL, 0);
-
-	/* Accessing shmem segment for the libro mastro's block number */
-    shmBlockNumber = shmget(SHM_BLOCK_NUMBER, sizeof(unsigned int), 0600);
-    if (shmBlockNumber == -1){
-		MSG_ERR("node.init(): shmBlockNumber, error while creating the shared memory segment.");
-        perror("\tshmBlockNumber ");
-		shutdown(EXIT_FAILURE); 
+	if(arenaCheck(arena) == -1){
+		MSG_ERR("node.init(): shmArena, the arena was made by another version of the master.");
+		exit(EXIT_FAILURE);
 	}
-    block_number = (unsigned int *)shmat(shmBlockNumber, NULL, 0);
-
-	/* Accessing shmem segment for the Libro Mastro */
-    shmLibroMastro = shmget(SHM_LIBROMASTRO_KEY, 
-							sizeof(block) * SO_REGISTRY_SIZE, 
-							0600);
-    if (shmLibroMastro == -1){
-		MSG_ERR("node.init(): shmLibroMastro, error while creating the shared memory segment.");
-        perror("\tshmLibroMastro ");
-		shutdown(EXIT_FAILURE);
+
+	conf = arenaRegion(arena, REGION_CONF);
+	shmNodesArray = arenaRegion(arena, REGION_NODES);
+	/* The users, used to find the accounts */
+	shmUsersArray = arenaRegion(arena, REGION_USERS);
+	balancesArray = arenaRegion(arena, REGION_BALANCES);
+	locksArray = arenaRegion(arena, REGION_LOCKS);
+	poolsArray = arenaRegion(arena, REGION_POOLS);
+	nodes_num = arenaRegion(arena, REGION_NODES_NUM);
+	lockNodes = &locksArray[LOCK_NODES];
+	lockUsers = &locksArray[LOCK_USERS];
+
+	if(conf[SO_PREFAULT])
+		for(i = 0; i < N_ARENA_REGIONS; i++)
+			arenaPrefault(arena, i);
+
+	/* The blocks are committed straight into the Libro Mastro file */
+	ledger = ledgerMap(LEDGER_FILENAME, 0);
+	if(ledger == NULL){
+		MSG_ERR("node.init(): error while mapping the Libro Mastro file.");
+        perror("\t" LEDGER_FILENAME);
+		exit(EXIT_FAILURE);
 	}
-	libroMastroArray = (block *)shmat(shmLibroMastro, NULL, 0);
 }
 
-/* Accessing to the semaphores for the shared memory */
-void init_semaphores()
+/* Compares two entries of the users index by PID */
+int cmp_user_index(const void *a, const void *b)
+{
+	pid_t pa = ((struct user_index *)a)->pid;
+	pid_t pb = ((struct user_index *)b)->pid;
+	return (pa > pb) - (pa < pb);
+}
+
+/* Builds the users index sorted by PID */
+void init_users_index()
 {
-	semNodes = semget(SEM_NODE_KEY, 3, 0600);
-	if(semNodes == -1){
-		MSG_ERR("node.init(): semNodes, error while getting the semaphore.");
-        perror("\tsemNodes ");
+	int i = 0;
+
+	usersIndex = malloc(sizeof(struct user_index) * conf[SO_USERS_NUM]);
+	if(usersIndex == NULL){
+		MSG_ERR("node.init(): usersIndex, error while allocating memory.");
 		shutdown(EXIT_FAILURE);
 	}
 
-	semBlockNumber = semget(SEM_BLOCK_NUMBER, 3, 0600);
-	if(semBlockNumber == -1){
-		MSG_ERR("node.init(): semBlockNumber, error while getting the semaphore.");
-        perror("\tsemBlockNumber ");
-		shutdown(EXIT_FAILURE);
+	block_signals(2, SIGINT, SIGTERM);
+	initReadFromShm(lockUsers);
+	for(i = 0; i < conf[SO_USERS_NUM]; i++){
+		usersIndex[i].pid = shmUsersArray[i].pid;
+		usersIndex[i].index = i;
 	}
+	endReadFromShm(lockUsers);
+	unblock_signals(2, SIGINT, SIGTERM);
+
+	qsort(usersIndex, conf[SO_USERS_NUM], sizeof(struct user_index), 
+		  cmp_user_index);
+}
 
-	semLibroMastro = semget(SEM_LIBROMASTRO_KEY, 3, 0600);
-    if(semLibroMastro == -1){
-		MSG_ERR("node.init(): semLibroMastro, error while getting the semaphore.");
-        perror("\tsemLibroMastro ");
+/* Picks SO_FRIENDS_NUM random nodes, different from this one */
+void init_friends()
+{
+	int i = 0;
+	int j = 0;
+	int tmp = 0;
+	int others = 0;
+
+	/* All the other nodes, the first friends_num are shuffled */
+	friends = malloc(sizeof(int) * conf[SO_MAX_NODES]);
+	if(friends == NULL){
+		MSG_ERR("node.init(): friends, error while allocating memory.");
 		shutdown(EXIT_FAILURE);
 	}
+	for(i = 0; i < *nodes_num; i++)
+		if(i != my_index)
+			friends[others++] = i;
+
+	friends_num = conf[SO_FRIENDS_NUM];
+	if(friends_num > others)
+		friends_num = others;
+	for(i = 0; i < friends_num; i++){
+		j = randomNum(i, others - 1);
+		tmp = friends[i];
+		friends[i] = friends[j];
+		friends[j] = tmp;
+	}
+}
 
-	semSimulation = semget(SEM_SIM_KEY, 1, 0600);
-    if(semSimulation == -1){
-		MSG_ERR("node.init(): semSimulation, error while getting the semaphore.");
-        perror("\tsemSimulation ");
-		shutdown(EXIT_FAILURE);
+/* -------------------- LIFETIME FUNCTIONS -------------------- */
+
+/* Returns the index of the user with the given PID, -1 if not a user */
+int get_user_index(int id)
+{
+	struct user_index key;
+	struct user_index *found;
+
+	key.pid = id;
+	found = bsearch(&key, usersIndex, conf[SO_USERS_NUM], 
+					sizeof(struct user_index), cmp_user_index);
+	return found != NULL ? found->index : -1;
+}
+
+/* 
+ * Sends the transactions over the threshold to the friend with the 
+ * emptiest pool, or to the master after SO_HOPS forwards. They are 
+ * removed from the pool only once they are in the other one.
+ */
+void forward_transactions()
+{
+	transaction trans[SO_BLOCK_SIZE];
+	int hops[SO_BLOCK_SIZE];
+	unsigned long waiting = 0;
+	unsigned long min = 0;
+	tpool *target;
+	tpool *friendPool;
+	int n = 0;
+	int i = 0;
+	int j = 0;
+
+	waiting = tpCount(myPool);
+	if(friends_num == 0 || waiting <= forward_threshold)
+		return;
+
+	n = waiting - forward_threshold;
+	if(n > SO_BLOCK_SIZE)
+		n = SO_BLOCK_SIZE;
+
+	block_signals(2, SIGINT, SIGTERM);
+	n = tpPeek(myPool, trans, hops, n);
+	for(i = 0; i < n; i++){
+		hops[i]++;
+		if(hops[i] > conf[SO_HOPS]){
+			target = masterPool;
+		} else {
+			target = tpGet(poolsArray, friends[0], conf[SO_TP_SIZE]);
+			min = tpCount(target);
+			for(j = 1; j < friends_num; j++){
+				friendPool = tpGet(poolsArray, friends[j], conf[SO_TP_SIZE]);
+				if(tpCount(friendPool) < min){
+					min = tpCount(friendPool);
+					target = friendPool;
+				}
+			}
+		}
+		if(tpPush(target, &trans[i], 1, &hops[i]) < 0)
+			break;
+		if(target == masterPool)
+			to_master++;
+		else
+			forwarded++;
 	}
+	tpDrop(myPool, i);
+	unblock_signals(2, SIGINT, SIGTERM);
 }
 
-/* Accessing the message queue, SO_TP_SIZE management */
-void init_msgqueue()
+/* 
+ * FIFO mode: every wakeup drains all the available transactions into 
+ * the block, returns 1 when the block is full
+ */
+int fill_block(transaction *trans)
 {
-	struct msqid_ds msg_params;
-	msglen_t msg_max_size_no_root;
+	int n = 0;
 
-	myTransactionsMsg = msgget(ftok(FTOK_PATHNAME_NODE, my_pid), 0600);
-    if(myTransactionsMsg == -1){
-		MSG_ERR("node.init(): myTransitionsMsg, error while getting the message queue.");
-        perror("\tmyTransitionsMsg ");
-		shutdown(EXIT_FAILURE);
+	n = tpPopBatch(myPool, &trans[count], SO_BLOCK_SIZE - 1 - count);
+	if(n == 0){
+		/* The pool is empty */
+		tpWait(myPool, NULL);
+		return 0;
 	}
+	count += n;
+	batches++;
+	batch_trans += n;
 
-	/* SO_TP_SIZE management */
-	msgctl(myTransactionsMsg, IPC_STAT, &msg_params);
+	return count == SO_BLOCK_SIZE - 1;
+}
 
-	/* 
-	 * Setting the max msgqueue size, when TP is full, 
-	 * the msgsnd() fails with EAGAIN
-	 */
-	msg_params.msg_qbytes = sizeof(msgbuf) * conf[SO_TP_SIZE];
-	msgctl(myTransactionsMsg, IPC_SET, &msg_params);
+/* 
+ * Priority mode: the pool is drained into the heap of the pending
+ * transactions, the block is made of the ones with the highest reward.
+ * Returns 1 when the block is full.
+ */
+int fill_block_priority(transaction *trans)
+{
+	int n = 0;
+	int i = 0;
+
+	n = tpPopBatch(myPool, &pending[pendingSize], 
+				   conf[SO_TP_SIZE] - pendingSize);
+	if(n > 0){
+		batches++;
+		batch_trans += n;
+		/* The new transactions are already at the end of the heap */
+		for(i = 0; i < n; i++)
+			pending_push(NULL);
+	} else if(pendingSize < SO_BLOCK_SIZE - 1){
+		/* The pool is empty */
+		tpWait(myPool, NULL);
+	}
+
+	if(pendingSize < SO_BLOCK_SIZE - 1)
+		return 0;
+
+	for(count = 0; count < SO_BLOCK_SIZE - 1; count++)
+		trans[count] = pending_pop();
+	return 1;
+}
+
+/* Higher reward first, the older transaction on the same reward */
+int higher_priority(transaction *a, transaction *b)
+{
+	if(a->reward != b->reward)
+		return a->reward > b->reward;
+	if(a->timestamp.tv_sec != b->timestamp.tv_sec)
+		return a->timestamp.tv_sec < b->timestamp.tv_sec;
+	return a->timestamp.tv_nsec < b->timestamp.tv_nsec;
+}
+
+/* 
+ * Adds a transaction to the heap, with NULL the transaction is the one
+ * already copied after the end of the heap
+ */
+void pending_push(transaction *trans)
+{
+	transaction tmp;
+	int i = pendingSize++;
+
+	if(trans != NULL)
+		pending[i] = *trans;
+
+	while(i > 0 && higher_priority(&pending[i], &pending[(i - 1) / 2])){
+		tmp = pending[i];
+		pending[i] = pending[(i - 1) / 2];
+		pending[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+/* Removes the transaction with the highest priority from the heap */
+transaction pending_pop()
+{
+	transaction top = pending[0];
+	transaction tmp;
+	int i = 0;
+	int child = 0;
+
+	pending[0] = pending[--pendingSize];
+	while((child = 2 * i + 1) < pendingSize){
+		if(child + 1 < pendingSize 
+		   && higher_priority(&pending[child + 1], &pending[child]))
+			child++;
+		if(!higher_priority(&pending[child], &pending[i]))
+			break;
+		tmp = pending[i];
+		pending[i] = pending[child];
+		pending[child] = tmp;
+		i = child;
+	}
+	return top;
 }
 
 /* -------------------- SIGNAL HANDLERS -------------------- */
@@ -305,14 +543,20 @@ void init_msgqueue()
 /* Receiving SIGINT from master process */
 void sigint_handler()
 {
-	msgbuf msg;
-	while(msgrcv(myTransactionsMsg, &msg, sizeof(msg), 0, IPC_NOWAIT) != -1)
-		unproc_trans++;
+	/* 
+	 * The transactions left in the pool, the main loop could be reading
+	 * one of them so the pool is not emptied here
+	 */
+	unproc_trans = tpCount(myPool);
 	
 	block_signals(2, SIGINT, SIGTERM);
-	initWriteInShm(semNodes);
-	shmNodesArray[my_index].unproc_trans = unproc_trans + count;
-	endWriteInShm(semNodes);
+	seqWriteBegin(&shmNodesArray[my_index].seq);
+	shmNodesArray[my_index].unproc_trans = unproc_trans + pendingSize + count;
+	shmNodesArray[my_index].batches = batches;
+	shmNodesArray[my_index].batch_trans = batch_trans;
+	shmNodesArray[my_index].forwarded = forwarded;
+	shmNodesArray[my_index].to_master = to_master;
+	seqWriteEnd(&shmNodesArray[my_index].seq);
 	
 	shutdown(EXIT_SUCCESS);
 }
@@ -322,36 +566,22 @@ void sigint_handler()
 void shutdown(int status)
 {
     /* Rimozione IPC */
-    /* detach the shmem for the nodes Array */
-    if(shmdt((void *)shmNodesArray) == -1){
-        MSG_ERR("node.shutdown(): shmNodesArray, error while detaching "
-                "the shmNodesArray shmem segment.");
-	}
-
-	/* detach the shmem for the libro mastro */
-    if(shmdt((void *)libroMastroArray) == -1){
-        MSG_ERR("node.shutdown(): libroMastroArray, error while detaching "
-                "the libroMastroArray shmem segment.");
-	}
-
-    /* detach the shmem for the last block number */
-    if(shmdt((void *)block_number) == -1){
-        MSG_ERR("node.shutdown(): block_number, error while detaching "
-                "the block_number shmem segment.");
-	}
-
-	/* detach the shmem for the configuration */
-    if(shmdt((void *)conf) == -1){
-        MSG_ERR("node.shutdown(): conf, error while detaching "
-                "the conf shmem segment.");
+    /* detach the shmem arena */
+    if(shmdt((void *)arena) == -1){
+        MSG_ERR("node.shutdown(): arena, error while detaching "
+                "the arena shmem segment.");
 	}
-
-    shmctl(shmNodes, IPC_RMID, NULL);
-    shmctl(shmLibroMastro, IPC_RMID, NULL);
-    shmctl(shmBlockNumber, IPC_RMID, NULL);
-    shmctl(shmConfig, IPC_RMID, NULL);
-
-	msgctl(myTransactionsMsg, IPC_RMID, NULL);
-
+    /* 
+     * The arena is not marked for removal here: a node can end before 
+     * the nodes spawned at runtime attach it, the master removes it at
+     * the end
+     */
+
+	if(ledger != NULL)
+		ledgerUnmap(ledger);
+
+	free(usersIndex);
+	free(pending);
+	free(friends);
 	exit(status);
 }
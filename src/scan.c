@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>      /* printf() */
+#include <stdlib.h>     /* malloc(), free() */
+#include "common.h"
+#include "bashprint.h"
+
+/*
+ * Scan bandwidth of the Libro Mastro layout of this build, made by
+ * make bench as bin/scan_aos and bin/scan_soa. A ledger of SCAN_BYTES is
+ * filled with random blocks, then it is read by:
+ *      balances  sender, receiver, quantity and reward of every
+ *                transaction, like ledgerApplyBalances()
+ *      rewards   only the rewards, like the sum of a node's block
+ * The best of SCAN_ROUNDS is printed, the bandwidth is over the bytes of
+ * the whole ledger so that the two layouts can be compared.
+ *
+ * Usage: bin/scan_aos [blocks]
+ */
+
+#define SCAN_BYTES (256 << 20)
+#define SCAN_ROUNDS 5
+#define SCAN_USERS 1000
+
+/* -------------------- PROTOTYPES -------------------- */
+
+void fill_ledger(block *blocks, unsigned int n);
+long scan_balances(block *blocks, unsigned int n);
+long scan_rewards(block *blocks, unsigned int n);
+void print_scan(const char *name, double msec, unsigned int n);
+double elapsed_msec(struct timespec *begin);
+
+/* -------------------- GLOBAL VARIABLES -------------------- */
+
+account balances[SCAN_USERS];   /* Written by scan_balances() */
+
+int main(int argc, char **argv)
+{
+    struct timespec begin;
+    block *blocks;
+    double balances_msec = -1;
+    double rewards_msec = -1;
+    double msec = 0;
+    unsigned int n = SCAN_BYTES / sizeof(block);
+    long check = 0;
+    int i = 0;
+
+    if(argc > 1)
+        n = atoi(argv[1]);
+    if(n < 1)
+        n = 1;
+
+    blocks = malloc((size_t)n * sizeof(block));
+    if(blocks == NULL){
+        MSG_ERR("scan: error while allocating the ledger.");
+        perror("\tmalloc ");
+        exit(EXIT_FAILURE);
+    }
+    initRandom(1, 0);
+    fill_ledger(blocks, n);
+
+    for(i = 0; i < SCAN_ROUNDS; i++){
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        check += scan_balances(blocks, n);
+        msec = elapsed_msec(&begin);
+        if(balances_msec < 0 || msec < balances_msec)
+            balances_msec = msec;
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        check += scan_rewards(blocks, n);
+        msec = elapsed_msec(&begin);
+        if(rewards_msec < 0 || msec < rewards_msec)
+            rewards_msec = msec;
+    }
+
+    printf("Layout: %s, %u blocks of %lu bytes (%.1f MB)\n",
+           LEDGER_LAYOUT_NAME, n, (unsigned long)sizeof(block),
+           (double)n * sizeof(block) / (1 << 20));
+    print_scan("balances", balances_msec, n);
+    print_scan("rewards", rewards_msec, n);
+    /* The results are used, the scans can't be optimized away */
+    printf("Check: %ld\n", check);
+
+    free(blocks);
+    return 0;
+}
+
+/* Random transactions, the last of every block is the reward */
+void fill_ledger(block *blocks, unsigned int n)
+{
+    transaction trans[SO_BLOCK_SIZE];
+    unsigned int i = 0;
+    int j = 0;
+
+    for(i = 0; i < n; i++){
+        for(j = 0; j < SO_BLOCK_SIZE; j++){
+            trans[j].timestamp.tv_sec = i;
+            trans[j].timestamp.tv_nsec = j;
+            trans[j].sender = randomNum(0, SCAN_USERS - 1);
+            trans[j].receiver = randomNum(0, SCAN_USERS - 1);
+            trans[j].quantity = randomNum(1, 100);
+            trans[j].reward = randomNum(1, 10);
+        }
+        trans[SO_BLOCK_SIZE - 1].sender = TRANS_REWARD_SENDER;
+        blockWrite(&blocks[i], i, trans);
+        blocks[i].published = 1;
+    }
+}
+
+/* Adds every block to the balances, returns the sum of the debits */
+long scan_balances(block *blocks, unsigned int n)
+{
+    block *b;
+    long debits = 0;
+    unsigned int i = 0;
+    int j = 0;
+
+    for(i = 0; i < n; i++){
+        b = &blocks[i];
+        for(j = 0; j < SO_BLOCK_SIZE; j++){
+            balances[BLOCK_RECEIVER(b, j)].credits += BLOCK_QUANTITY(b, j);
+            if(BLOCK_SENDER(b, j) == TRANS_REWARD_SENDER)
+                continue;
+            balances[BLOCK_SENDER(b, j)].debits += BLOCK_QUANTITY(b, j)
+                                                   + BLOCK_REWARD(b, j);
+            debits += BLOCK_QUANTITY(b, j) + BLOCK_REWARD(b, j);
+        }
+    }
+    return debits;
+}
+
+/* Returns the sum of the rewards of all the blocks */
+long scan_rewards(block *blocks, unsigned int n)
+{
+    block *b;
+    long rewards = 0;
+    unsigned int i = 0;
+    int j = 0;
+
+    for(i = 0; i < n; i++){
+        b = &blocks[i];
+        for(j = 0; j < SO_BLOCK_SIZE; j++)
+            rewards += BLOCK_REWARD(b, j);
+    }
+    return rewards;
+}
+
+/* Time of a scan and bandwidth over the bytes of the ledger */
+void print_scan(const char *name, double msec, unsigned int n)
+{
+    printf("Scan %-8s: %9.3f ms, %6.2f GB/s, %7.1f M transactions/s\n",
+           name, msec, (double)n * sizeof(block) / msec / 1e6,
+           (double)n * SO_BLOCK_SIZE / msec / 1e3);
+}
+
+/* Milliseconds from begin */
+double elapsed_msec(struct timespec *begin)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) * 1e3
+           + (now.tv_nsec - begin->tv_nsec) / 1e6;
+}
@@ -0,0 +1,947 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>      /* printf(), fopen() */
+#include <stdlib.h>     /* posix_memalign(), free() */
+#include <limits.h>     /* Limits of numbers macros */
+#include <unistd.h>     /* sysconf() */
+#include <pthread.h>    /* pthread_create(), pthread_join() */
+#include <time.h>       /* clock_gettime(), clock_nanosleep() */
+#include "common.h"
+#include "bashprint.h"
+
+/*
+ * Threaded simulation: the same Libro Mastro, balances, users/nodes
+ * tables and transaction pools of the master, in the memory of a single
+ * process. The users are tasks run by a worker thread per core, every
+ * node is a thread. There are no PIDs: the users are identified by
+ * index + 1, the nodes by SO_USERS_NUM + index + 1.
+ * With SO_VIRTUAL_TIME there are no threads: a discrete event loop moves
+ * a virtual clock to the next user transaction or node commit, nothing
+ * sleeps and the simulation runs as fast as the CPU allows.
+ */
+
+/* Force to print all the stats at the end of the simulation */
+#define FORCE_PRINT_STATS 1
+/* The print_stats(int) function will just print the useful info */
+#define PRINT_USEFUL_STATS 0
+/* Other nodes tried when the pool of the chosen one is full */
+#define MAX_REDIRECTS 2
+/* The nodes check the end of the simulation at least this often */
+#define NODE_WAIT_NSEC 50000000
+
+#define USER_ID(index) ((index) + 1)
+#define NODE_ID(index) ((int)conf[SO_USERS_NUM] + (index) + 1)
+
+/* Kinds of the events of the virtual time loop */
+#define EVENT_USER 0
+#define EVENT_NODE 1
+
+/* State of a user task, only its worker thread uses it */
+typedef struct
+{
+    int speso;              /* Quantities and rewards of the sent trans. */
+    int fails;              /* Failed transaction attempts */
+    struct timespec wake;   /* Time of the next transaction */
+    rng_state rng;          /* Random numbers of the user's slot */
+} user_task;
+
+/* State of a node thread */
+typedef struct
+{
+    pthread_t thread;
+    int index;              /* Index in nodesArray and in the pools */
+    rng_state rng;          /* Random numbers of the node's slot */
+    int reward_budget;      /* Node's reward */
+    int count;              /* Transaction number in a block */
+    int busy;               /* Virtual time, the block is being processed */
+    transaction transSet[SO_BLOCK_SIZE]; /* Block being filled */
+    unsigned int batches;   /* Number of non empty reads of the pool */
+    unsigned int batch_trans; /* Transactions read from the pool */
+    /* Commit latency of the transactions, grouped by reward */
+    unsigned int lat_count[N_REWARD_BUCKETS];
+    unsigned long lat_sum_usec[N_REWARD_BUCKETS];
+    unsigned long lat_max_usec[N_REWARD_BUCKETS];
+} node_task;
+
+/* Event of the virtual time loop */
+typedef struct
+{
+    struct timespec time;   /* Virtual time of the event */
+    int kind;               /* EVENT_USER or EVENT_NODE */
+    int index;              /* Index of the user or of the node */
+} sim_event;
+
+/* -------------------- PROTOTYPES -------------------- */
+
+/* Initialization */
+void init();
+void *sim_alloc(size_t size);
+void start_threads();
+void run_threads();
+
+/* Lifetime */
+void *worker_run(void *arg);
+void user_step(int index, transaction *burst, struct timespec *now);
+int create_transaction(int index, int bilancio, transaction *burst);
+int choose_node(int exclude, rng_state *rng);
+void user_dies(int index, int bilancio);
+void *node_run(void *arg);
+int fill_block(node_task *nt, tpool *pool);
+void add_reward(node_task *nt);
+int commit_block(node_task *nt);
+void node_exit(node_task *nt);
+int get_user_index(int id);
+void write_node_slot(node_task *nt);
+void end_simulation(int reason);
+int time_before(struct timespec *a, struct timespec *b);
+void time_add(struct timespec *t, long nsec);
+void sim_clock(struct timespec *t);
+
+/* Virtual time */
+void run_virtual();
+void node_feed(node_task *nt);
+void event_push(struct timespec *time, int kind, int index);
+sim_event event_pop();
+
+/* Stats */
+void print_stats(int force_print);
+void print_run_info();
+
+/* Termination */
+void join_threads();
+void shutdown(int status);
+
+/* -------------------- GLOBAL VARIABLES -------------------- */
+
+/**** SIMULATION DATA, SAME LAYOUT OF THE SHMEM ARENA ****/
+arena_header *arena;          /* Arena, the regions follow */
+unsigned long *conf;          /* Configuration values */
+unsigned long env_conf[N_RUNTIME_CONF_VALUES]; /* Read before the arena */
+user *usersArray;             /* Users table */
+node *nodesArray;             /* Nodes table */
+ledger_header *ledger;        /* Libro Mastro file, the blocks follow */
+block *libroMastroArray;      /* Array of blocks */
+unsigned int *block_number;   /* Libro Mastro block counters */
+account *balancesArray;       /* Committed balances */
+void *poolsArray;             /* Transaction pools of the nodes */
+int nodes_num;                /* Number of nodes in the table */
+block_export blockExport;     /* Published blocks written during the run */
+
+/**** THREADS ****/
+user_task *userTasks;         /* Users' state, by user index */
+node_task *nodeTasks;         /* Nodes' state, by node index */
+pthread_t *workers;           /* Worker threads running the users */
+int workers_num;              /* One worker per core */
+int workers_started;          /* Worker threads to join */
+int nodes_started;            /* Node threads to join */
+
+/**** TERMINATION ****/
+volatile int sim_over;        /* Set to 1 to stop the threads */
+volatile int term_reason;     /* Defines reason of termination */
+volatile unsigned int mainFutex; /* Changed to wake the main thread */
+
+/**** VIRTUAL TIME ****/
+int virtual_mode;             /* Boolean, SO_VIRTUAL_TIME */
+struct timespec vclock;       /* Virtual time, starts at 0 */
+struct timespec vstart;       /* Virtual time of the start */
+sim_event *events;            /* Min heap of the pending events */
+int events_num;               /* Events in the heap */
+
+/**** STATISTICAL VARIABLES ****/
+volatile int remaining_users; /* Number of active users */
+volatile int early_deaths;    /* Number of early death users */
+struct timespec sim_start;    /* Start time of the simulation */
+struct timespec sim_end;      /* Start of the termination */
+
+int main(int argc, char **argv)
+{
+    /* (1): Get simulation configuration, allocate the data structures */
+    init();
+
+    /* (2), (3): Run the simulation until a termination condition */
+    clock_gettime(CLOCK_MONOTONIC, &sim_start);
+    if(virtual_mode)
+        run_virtual();
+    else
+        run_threads();
+    clock_gettime(CLOCK_MONOTONIC, &sim_end);
+
+    /* (4): Stop the threads, print the final stats */
+    sim_over = 1;
+    join_threads();
+    print_stats(FORCE_PRINT_STATS);
+    shutdown(EXIT_SUCCESS);
+
+    return 0;
+}
+
+/*
+ * Starts the nodes and the workers running the users, then prints stats
+ * every second until a termination condition. The threads wake the main
+ * thread when the blockchain is full or there are no more active users.
+ */
+void run_threads()
+{
+    struct timespec now;
+    struct timespec next;
+    struct timespec end;
+    struct timespec req;
+    unsigned int val;
+
+    start_threads();
+    next = sim_start;
+    next.tv_sec++;
+    end = sim_start;
+    end.tv_sec += conf[SO_SIM_SEC];
+    while(term_reason == 0){
+        val = mainFutex;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        req.tv_sec = next.tv_sec - now.tv_sec;
+        req.tv_nsec = next.tv_nsec - now.tv_nsec;
+        if(req.tv_nsec < 0){
+            req.tv_sec--;
+            req.tv_nsec += 1000000000L;
+        }
+        if(req.tv_sec >= 0 && term_reason == 0)
+            futexWait(&mainFutex, val, &req);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(!time_before(&now, &end)){
+            /* Reason (2) for termination: SO_SIM_SEC elapsed */
+            end_simulation(2);
+        } else if(!time_before(&now, &next) && term_reason == 0){
+            print_stats(PRINT_USEFUL_STATS);
+            exportBlocks(&blockExport, libroMastroArray,
+                         *(volatile unsigned int *)block_number);
+            next.tv_sec++;
+        }
+    }
+}
+
+/* -------------------- INITIALIZATION FUNCTIONS -------------------- */
+
+#pragma region INITIALIZATION
+
+/* Reads the configuration and allocates the simulation data */
+void init()
+{
+    arena_header layout;
+    int i = 0;
+
+    sim_over = 0;
+    term_reason = 0;
+    mainFutex = 0;
+    early_deaths = 0;
+    workers_started = 0;
+    nodes_started = 0;
+    arena = NULL;
+    ledger = NULL;
+    blockExport.fp = NULL;
+    userTasks = NULL;
+    nodeTasks = NULL;
+    workers = NULL;
+    events = NULL;
+    events_num = 0;
+
+    if(readConfiguration(env_conf) == -1)
+        shutdown(EXIT_FAILURE);
+    conf = env_conf;
+    if(conf[SO_PRIORITY] || conf[SO_MAX_NODES] > conf[SO_NODES_NUM]
+       || conf[SO_HUGE_PAGES] || conf[SO_PLACEMENT]){
+        MSG_WARNING("sim: SO_PRIORITY, SO_MAX_NODES, SO_HUGE_PAGES and SO_PLACEMENT are ignored by the threaded simulation.");
+    }
+    nodes_num = conf[SO_NODES_NUM];
+    remaining_users = conf[SO_USERS_NUM];
+    virtual_mode = conf[SO_VIRTUAL_TIME];
+
+    /* A worker thread per core, no more than the users */
+    workers_num = sysconf(_SC_NPROCESSORS_ONLN);
+    if(workers_num < 1)
+        workers_num = 1;
+    if(workers_num > conf[SO_USERS_NUM])
+        workers_num = conf[SO_USERS_NUM];
+
+    arena = sim_alloc(arenaLayout(&layout, conf));
+    *arena = layout;
+    memcpy(arenaRegion(arena, REGION_CONF), env_conf, sizeof(env_conf));
+    conf = arenaRegion(arena, REGION_CONF);
+    usersArray = arenaRegion(arena, REGION_USERS);
+    nodesArray = arenaRegion(arena, REGION_NODES);
+    balancesArray = arenaRegion(arena, REGION_BALANCES);
+    poolsArray = arenaRegion(arena, REGION_POOLS);
+    ledger = ledgerMap(LEDGER_FILENAME, 1);
+    if(ledger == NULL){
+        MSG_ERR("sim.init(): error while creating the Libro Mastro file.");
+        perror("\t" LEDGER_FILENAME);
+        shutdown(EXIT_FAILURE);
+    }
+    libroMastroArray = ledgerBlocks(ledger);
+    block_number = ledger->block_number;
+    /* The main thread exports the published blocks every second */
+    if(exportOpen(&blockExport, EXPORT_FILENAME, EXPORT_PART_FILENAME) == -1){
+        MSG_ERR("sim.init(): error while creating the blockchain export.");
+        perror("\t" EXPORT_PART_FILENAME);
+        shutdown(EXIT_FAILURE);
+    }
+    userTasks = sim_alloc(sizeof(user_task) * conf[SO_USERS_NUM]);
+    nodeTasks = sim_alloc(sizeof(node_task) * nodes_num);
+    workers = sim_alloc(sizeof(pthread_t) * workers_num);
+    if(virtual_mode){
+        /* A pending event for every user and every node at most */
+        events = sim_alloc(sizeof(sim_event)
+                           * (conf[SO_USERS_NUM] + nodes_num));
+        /* The same seed writes the same Libro Mastro, timestamps too */
+        vclock.tv_sec = 0;
+        vclock.tv_nsec = 0;
+        vstart = vclock;
+    }
+
+    for(i = 0; i < conf[SO_USERS_NUM]; i++){
+        usersArray[i].pid = USER_ID(i);
+        usersArray[i].budget = conf[SO_BUDGET_INIT];
+        usersArray[i].alive = 1;
+        rngSeed(&userTasks[i].rng, conf[SO_SEED], USER_STREAM(i));
+    }
+    for(i = 0; i < nodes_num; i++){
+        nodesArray[i].pid = NODE_ID(i);
+        nodeTasks[i].index = i;
+        rngSeed(&nodeTasks[i].rng, conf[SO_SEED], NODE_STREAM(i));
+        tpInit(tpGet(poolsArray, i, conf[SO_TP_SIZE]), conf[SO_TP_SIZE]);
+    }
+}
+
+/* Allocates zero filled memory, aligned to a cache line */
+void *sim_alloc(size_t size)
+{
+    void *p = NULL;
+
+    if(posix_memalign(&p, CACHE_LINE_SIZE, size) != 0){
+        MSG_ERR("sim.init(): error while allocating memory.");
+        shutdown(EXIT_FAILURE);
+    }
+    memset(p, 0, size);
+    return p;
+}
+
+/* Starts the node threads, then the workers running the users */
+void start_threads()
+{
+    long i = 0;
+
+    for(i = 0; i < nodes_num; i++){
+        if(pthread_create(&nodeTasks[i].thread, NULL, node_run,
+                          &nodeTasks[i]) != 0){
+            MSG_ERR("sim.start_threads(): error while creating a node thread.");
+            sim_over = 1;
+            join_threads();
+            shutdown(EXIT_FAILURE);
+        }
+        nodes_started++;
+    }
+
+    for(i = 0; i < workers_num; i++){
+        if(pthread_create(&workers[i], NULL, worker_run, (void *)i) != 0){
+            MSG_ERR("sim.start_threads(): error while creating a worker thread.");
+            sim_over = 1;
+            join_threads();
+            shutdown(EXIT_FAILURE);
+        }
+        workers_started++;
+    }
+}
+
+#pragma endregion /* INITIALIZATION */
+
+/* -------------------- LIFETIME FUNCTIONS -------------------- */
+
+#pragma region LIFETIME
+
+/*
+ * Worker thread: runs the users index % workers_num == w. Every pass
+ * makes a step of the users whose time came, then the worker sleeps
+ * until the earliest next transaction.
+ */
+void *worker_run(void *arg)
+{
+    int w = (long)arg;
+    int i = 0;
+    transaction *burst;
+    struct timespec now;
+    struct timespec next;
+
+    burst = malloc(sizeof(transaction) * conf[SO_TRANS_BURST]);
+    if(burst == NULL){
+        MSG_ERR("sim.worker_run(): burst, error while allocating memory.");
+        return NULL;
+    }
+
+    while(!sim_over){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        next = now;
+        next.tv_nsec += NODE_WAIT_NSEC;
+        if(next.tv_nsec >= 1000000000L){
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+
+        for(i = w; i < conf[SO_USERS_NUM] && !sim_over; i += workers_num){
+            if(!usersArray[i].alive)
+                continue;
+            if(!time_before(&now, &userTasks[i].wake))
+                user_step(i, burst, &now);
+            if(usersArray[i].alive && time_before(&userTasks[i].wake, &next))
+                next = userTasks[i].wake;
+        }
+
+        if(time_before(&now, &next))
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    free(burst);
+    return NULL;
+}
+
+/* One iteration of the user's loop, the same of bin/user */
+void user_step(int index, transaction *burst, struct timespec *now)
+{
+    user_task *task = &userTasks[index];
+    int bilancio;
+    long nsec;
+
+    bilancio = conf[SO_BUDGET_INIT] + balancesArray[index].credits
+               - task->speso;
+    seqWriteBegin(&usersArray[index].seq);
+    usersArray[index].budget = bilancio;
+    seqWriteEnd(&usersArray[index].seq);
+
+    if(bilancio >= 2 && create_transaction(index, bilancio, burst)){
+        nsec = rngRange(&task->rng, conf[SO_MIN_TRANS_GEN_NSEC],
+                        conf[SO_MAX_TRANS_GEN_NSEC]);
+        task->wake = *now;
+        time_add(&task->wake, nsec);
+    } else if(++task->fails >= conf[SO_RETRY]){
+        user_dies(index, bilancio);
+    }
+}
+
+/*
+ * Creates a burst of up to SO_TRANS_BURST transactions and sends them
+ * to a node transaction pool with a single push
+ */
+int create_transaction(int index, int bilancio, transaction *burst)
+{
+    rng_state *rng = &userTasks[index].rng;
+    struct timespec timestamp;
+    int try_receiver_count = 0;
+    int n = 0;             /* Transactions in the burst */
+    int available;         /* Budget not used by the burst */
+    int pushed;
+
+    user receiver;         /* Snapshot of the receiver's slot */
+    int randomReceiverId;  /* Random user */
+    int nodeId;            /* Chosen node */
+    int redirects = 0;     /* Nodes tried after the first one */
+    int randomQuantity;    /* Random quantity for the transaction */
+    int nodeReward;        /* Transaction reward */
+
+    available = bilancio;
+    while(n < conf[SO_TRANS_BURST] && available >= 2){
+        try_receiver_count = 0;
+        do{
+            randomReceiverId = rngRange(rng, 0, conf[SO_USERS_NUM] - 1);
+            seqReadCopy(&usersArray[randomReceiverId].seq, &receiver,
+                        &usersArray[randomReceiverId], sizeof(user));
+            try_receiver_count++;
+        }
+        while(randomReceiverId == index
+              && !receiver.alive
+              && try_receiver_count < 6);
+
+        if(try_receiver_count == 6)
+            break;
+
+        randomQuantity = rngRange(rng, 2, available);
+
+        nodeReward = (int)(randomQuantity * conf[SO_REWARD] / 100);
+        if(nodeReward == 0)
+            nodeReward = 1;
+
+        randomQuantity -= nodeReward;
+
+        sim_clock(&timestamp);
+        burst[n].quantity = randomQuantity;
+        burst[n].receiver = receiver.pid;
+        burst[n].reward = nodeReward;
+        burst[n].sender = USER_ID(index);
+        burst[n].timestamp = timestamp;
+
+        available -= randomQuantity + nodeReward;
+        n++;
+    }
+
+    if(n == 0)
+        return 0;
+
+    nodeId = choose_node(-1, rng);
+    pushed = tpPush(tpGet(poolsArray, nodeId, conf[SO_TP_SIZE]),
+                    burst, n, NULL);
+    while(pushed < 0 && redirects < MAX_REDIRECTS
+          && redirects < nodes_num - 1){
+        nodeId = choose_node(nodeId, rng);
+        pushed = tpPush(tpGet(poolsArray, nodeId, conf[SO_TP_SIZE]),
+                        burst, n, NULL);
+        redirects++;
+    }
+
+    if(redirects > 0 || pushed < 0){
+        seqWriteBegin(&usersArray[index].seq);
+        usersArray[index].redirects += redirects;
+        if(pushed < 0)
+            usersArray[index].rejects++;
+        seqWriteEnd(&usersArray[index].seq);
+    }
+
+    if(pushed < 0)
+        return 0;
+    userTasks[index].speso += bilancio - available;
+    return 1;
+}
+
+/* Power of two choices on the pools occupancy, like bin/user */
+int choose_node(int exclude, rng_state *rng)
+{
+    int first;
+    int second;
+
+    do{
+        first = rngRange(rng, 0, nodes_num - 1);
+    } while(first == exclude);
+    do{
+        second = rngRange(rng, 0, nodes_num - 1);
+    } while(second == exclude);
+
+    if(tpCount(tpGet(poolsArray, second, conf[SO_TP_SIZE]))
+       < tpCount(tpGet(poolsArray, first, conf[SO_TP_SIZE])))
+        return second;
+    return first;
+}
+
+/* The user failed SO_RETRY times, the last one wakes the main thread */
+void user_dies(int index, int bilancio)
+{
+    seqWriteBegin(&usersArray[index].seq);
+    usersArray[index].budget = bilancio;
+    usersArray[index].alive = 0;
+    seqWriteEnd(&usersArray[index].seq);
+
+    if(!sim_over)
+        __sync_fetch_and_add(&early_deaths, 1);
+    if(__sync_sub_and_fetch(&remaining_users, 1) == 0){
+        /* Reason (3) for termination: All the users stopped */
+        end_simulation(3);
+    }
+}
+
+/* Node thread: the main loop of bin/node in FIFO mode */
+void *node_run(void *arg)
+{
+    node_task *nt = (node_task *)arg;
+    tpool *myPool = tpGet(poolsArray, nt->index, conf[SO_TP_SIZE]);
+    struct timespec t;
+
+    while(!sim_over){
+        if(!fill_block(nt, myPool))
+            continue;
+        add_reward(nt);
+
+        /* processing */
+        t.tv_sec = 0;
+        t.tv_nsec = rngRange(&nt->rng, conf[SO_MIN_TRANS_PROC_NSEC],
+                             conf[SO_MAX_TRANS_PROC_NSEC]);
+        nanosleep(&t, &t);
+
+        if(!commit_block(nt))
+            break;
+    }
+
+    node_exit(nt);
+    return NULL;
+}
+
+/*
+ * Drains the available transactions into the block, waits on the pool
+ * when it is empty (not in virtual time). Returns 1 when the block is 
+ * full.
+ */
+int fill_block(node_task *nt, tpool *pool)
+{
+    struct timespec timeout = {0, NODE_WAIT_NSEC};
+    int n = 0;
+
+    n = tpPopBatch(pool, &nt->transSet[nt->count],
+                   SO_BLOCK_SIZE - 1 - nt->count);
+    if(n == 0){
+        /* The pool is empty */
+        if(!virtual_mode)
+            tpWait(pool, &timeout);
+        return 0;
+    }
+    nt->count += n;
+    nt->batches++;
+    nt->batch_trans += n;
+
+    return nt->count == SO_BLOCK_SIZE - 1;
+}
+
+/* Adds the reward transaction at the end of the full block */
+void add_reward(node_task *nt)
+{
+    transaction reward;
+    int sum_rewards = 0;
+    int i = 0;
+
+    for(i = 0; i < nt->count; i++)
+        sum_rewards += nt->transSet[i].reward;
+
+    sim_clock(&reward.timestamp);
+    reward.sender = TRANS_REWARD_SENDER;
+    reward.receiver = NODE_ID(nt->index);
+    reward.quantity = sum_rewards;
+    reward.reward = 0;
+    nt->transSet[nt->count] = reward;
+}
+
+/* 
+ * Writes the processed block in the Libro Mastro. Returns 0 when it is 
+ * full, the block stays unprocessed.
+ */
+int commit_block(node_task *nt)
+{
+    struct timespec now;
+    block *b;
+    int last = 0;
+
+    b = ledgerCommit(ledger, nt->transSet, balancesArray, get_user_index,
+                     &nt->reward_budget, &last);
+
+    /* libro mastro is full, the block stays unprocessed */
+    if(b == NULL)
+        return 0;
+    if(last){
+        /* Reason (1) for termination: The blockchain is full */
+        end_simulation(1);
+    }
+    sim_clock(&now);
+    blockLatencies(b, &now, nt->lat_count, nt->lat_sum_usec, 
+                   nt->lat_max_usec);
+
+    nt->count = 0;
+    write_node_slot(nt);
+    return 1;
+}
+
+/* Last write of the node's slot, with the unprocessed transactions */
+void node_exit(node_task *nt)
+{
+    write_node_slot(nt);
+    seqWriteBegin(&nodesArray[nt->index].seq);
+    nodesArray[nt->index].unproc_trans = nt->count
+        + tpCount(tpGet(poolsArray, nt->index, conf[SO_TP_SIZE]));
+    seqWriteEnd(&nodesArray[nt->index].seq);
+}
+
+/* Returns the index of the user with the given id, -1 if not a user */
+int get_user_index(int id)
+{
+    if(id < USER_ID(0) || id > USER_ID(conf[SO_USERS_NUM] - 1))
+        return -1;
+    return id - USER_ID(0);
+}
+
+/* Copies the node's counters in its slot of the nodes table */
+void write_node_slot(node_task *nt)
+{
+    node *slot = &nodesArray[nt->index];
+    int i = 0;
+
+    seqWriteBegin(&slot->seq);
+    slot->reward = nt->reward_budget;
+    slot->batches = nt->batches;
+    slot->batch_trans = nt->batch_trans;
+    for(i = 0; i < N_REWARD_BUCKETS; i++){
+        slot->lat_count[i] = nt->lat_count[i];
+        slot->lat_sum_usec[i] = nt->lat_sum_usec[i];
+        slot->lat_max_usec[i] = nt->lat_max_usec[i];
+    }
+    seqWriteEnd(&slot->seq);
+}
+
+/* Sets the reason of termination, only the first one is kept */
+void end_simulation(int reason)
+{
+    if(__sync_bool_compare_and_swap(&term_reason, 0, reason)){
+        __sync_fetch_and_add(&mainFutex, 1);
+        futexWake(&mainFutex, 1);
+    }
+}
+
+/* Returns 1 if a comes before b */
+int time_before(struct timespec *a, struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec
+           || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Adds nsec nanoseconds to t */
+void time_add(struct timespec *t, long nsec)
+{
+    t->tv_nsec += nsec;
+    while(t->tv_nsec >= 1000000000L){
+        t->tv_sec++;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Time of the timestamps: the virtual one in virtual time */
+void sim_clock(struct timespec *t)
+{
+    if(virtual_mode)
+        *t = vclock;
+    else
+        clock_gettime(CLOCK_REALTIME, t);
+}
+
+#pragma endregion /* LIFETIME */
+
+/* -------------------- VIRTUAL TIME FUNCTIONS -------------------- */
+
+#pragma region VIRTUAL_TIME
+
+/*
+ * Discrete event loop: the virtual clock jumps to the earliest event, a
+ * user transaction or a node commit, and runs it. The stats are printed
+ * every virtual second, SO_SIM_SEC is virtual time too.
+ */
+void run_virtual()
+{
+    struct timespec next;
+    struct timespec end;
+    transaction *burst;
+    sim_event ev;
+    int i = 0;
+
+    burst = malloc(sizeof(transaction) * conf[SO_TRANS_BURST]);
+    if(burst == NULL){
+        MSG_ERR("sim.run_virtual(): burst, error while allocating memory.");
+        shutdown(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < conf[SO_USERS_NUM]; i++){
+        userTasks[i].wake = vclock;
+        event_push(&userTasks[i].wake, EVENT_USER, i);
+    }
+    next = vclock;
+    next.tv_sec++;
+    end = vclock;
+    end.tv_sec += conf[SO_SIM_SEC];
+
+    while(term_reason == 0 && events_num > 0){
+        if(!time_before(&events[0].time, &end)){
+            /* Reason (2) for termination: SO_SIM_SEC elapsed */
+            vclock = end;
+            end_simulation(2);
+            break;
+        }
+        if(!time_before(&events[0].time, &next)){
+            vclock = next;
+            print_stats(PRINT_USEFUL_STATS);
+            exportBlocks(&blockExport, libroMastroArray, *block_number);
+            next.tv_sec++;
+            continue;
+        }
+
+        ev = event_pop();
+        vclock = ev.time;
+        if(ev.kind == EVENT_USER){
+            user_step(ev.index, burst, &vclock);
+            if(usersArray[ev.index].alive)
+                event_push(&userTasks[ev.index].wake, EVENT_USER, ev.index);
+            /* The idle nodes read the new transactions */
+            for(i = 0; i < nodes_num; i++)
+                node_feed(&nodeTasks[i]);
+        } else {
+            nodeTasks[ev.index].busy = 0;
+            if(commit_block(&nodeTasks[ev.index]))
+                node_feed(&nodeTasks[ev.index]);
+        }
+    }
+
+    for(i = 0; i < nodes_num; i++)
+        node_exit(&nodeTasks[i]);
+    free(burst);
+}
+
+/*
+ * An idle node fills its block from the pool, a full block is committed
+ * after the processing time
+ */
+void node_feed(node_task *nt)
+{
+    struct timespec done;
+
+    if(nt->busy
+       || !fill_block(nt, tpGet(poolsArray, nt->index, conf[SO_TP_SIZE])))
+        return;
+    add_reward(nt);
+    nt->busy = 1;
+    done = vclock;
+    time_add(&done, rngRange(&nt->rng, conf[SO_MIN_TRANS_PROC_NSEC],
+                             conf[SO_MAX_TRANS_PROC_NSEC]));
+    event_push(&done, EVENT_NODE, nt->index);
+}
+
+/* Adds an event to the min heap ordered by time */
+void event_push(struct timespec *time, int kind, int index)
+{
+    int i = events_num++;
+    int parent = 0;
+
+    while(i > 0){
+        parent = (i - 1) / 2;
+        if(!time_before(time, &events[parent].time))
+            break;
+        events[i] = events[parent];
+        i = parent;
+    }
+    events[i].time = *time;
+    events[i].kind = kind;
+    events[i].index = index;
+}
+
+/* Removes the earliest event from the heap, it must not be empty */
+sim_event event_pop()
+{
+    sim_event top = events[0];
+    sim_event last = events[--events_num];
+    int i = 0;
+    int child = 0;
+
+    while((child = 2 * i + 1) < events_num){
+        if(child + 1 < events_num
+           && time_before(&events[child + 1].time, &events[child].time))
+            child++;
+        if(!time_before(&events[child].time, &last.time))
+            break;
+        events[i] = events[child];
+        i = child;
+    }
+    events[i] = last;
+    return top;
+}
+
+#pragma endregion /* VIRTUAL_TIME */
+
+/* -------------------- STATS FUNCTIONS -------------------- */
+
+#pragma region STATS
+
+/* Prints the useful stats in lifetime, Prints all the info before exit() */
+void print_stats(int force_print)
+{
+    struct timespec begin;
+    struct timespec end;
+    double export_msec = 0;
+
+    if(force_print){
+        /* Only the blocks published after the last export are left */
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if(exportClose(&blockExport, libroMastroArray, *block_number) == -1){
+            MSG_ERR("sim.print_stats(): error while writing " EXPORT_FILENAME ".");
+            perror("\texport ");
+            fprintf(stderr, "\tthe blocks are kept in " EXPORT_PART_FILENAME "\n");
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        export_msec = (end.tv_sec - begin.tv_sec) * 1e3
+                      + (end.tv_nsec - begin.tv_nsec) / 1e6;
+
+        printAllUsers(usersArray, balancesArray, conf);
+        printAllNodes(nodesArray, nodes_num, 1);
+        printf("Users died too early: [%d/%lu]\n",
+               early_deaths, conf[SO_USERS_NUM]);
+
+        printf("# of blocks: %d\n", *block_number);
+        print_run_info();
+        printf("Seed: %lu\n", conf[SO_SEED]);
+        printf("Libro Mastro: %s, checksum %08x, %s layout\n", 
+               LEDGER_FILENAME, ledger->checksum, LEDGER_LAYOUT_NAME);
+        printf("Blockchain export: %.3f ms at the end\n", export_msec);
+
+        /* Seconds of virtual time in virtual time */
+        if(virtual_mode)
+            printBlockRate(*block_number, &vstart, &vclock);
+        else
+            printBlockRate(*block_number, &sim_start, &sim_end);
+        printBatchFill(nodesArray, nodes_num);
+        printPushStats(usersArray, conf);
+        /* SO_PRIORITY is ignored, the nodes fill the blocks in order */
+        printCommitLatency(nodesArray, nodes_num, 0);
+        printEndReason(term_reason, *block_number, conf);
+    } else {
+        printActiveStats(usersArray, balancesArray, remaining_users,
+                         nodesArray, nodes_num, nodes_num, conf);
+    }
+}
+
+/* Prints the threads used or, in virtual time, the time simulated */
+void print_run_info()
+{
+    if(!virtual_mode){
+        printf("Worker threads: %d for %lu users\n",
+               workers_num, conf[SO_USERS_NUM]);
+        return;
+    }
+    printf("Virtual time: %.3f s simulated in %.3f s\n",
+           (vclock.tv_sec - vstart.tv_sec)
+           + (vclock.tv_nsec - vstart.tv_nsec) / 1e9,
+           (sim_end.tv_sec - sim_start.tv_sec)
+           + (sim_end.tv_nsec - sim_start.tv_nsec) / 1e9);
+}
+
+#pragma endregion /* STATS */
+
+/* -------------------- TERMINATION FUNCTIONS -------------------- */
+
+#pragma region TERMINATION
+
+/* Waits for the started threads, sim_over must be already set */
+void join_threads()
+{
+    int i = 0;
+
+    for(i = 0; i < workers_started; i++)
+        pthread_join(workers[i], NULL);
+    for(i = 0; i < nodes_started; i++)
+        pthread_join(nodeTasks[i].thread, NULL);
+}
+
+/* Memory free, exit */
+void shutdown(int status)
+{
+    if(ledger != NULL){
+        ledgerSync(ledger);
+        ledgerUnmap(ledger);
+    }
+    if(blockExport.fp != NULL){
+        fclose(blockExport.fp);
+        free(blockExport.buffer);
+    }
+    free(arena);
+    free(userTasks);
+    free(nodeTasks);
+    free(workers);
+    free(events);
+
+    exit(status);
+}
+
+#pragma endregion /* TERMINATION */
@@ -1,4 +1,6 @@
 #define _GNU_SOURCE
+/* Other nodes tried when the pool of the chosen one is full */
+#define MAX_REDIRECTS 2
 #include <stdio.h>      /* printf(), fgets() */
 #include <stdlib.h>     /* atoi(), calloc(), free(), getenv() */ 
 #include "common.h"
@@ -7,18 +9,14 @@
 /* -------------------- PROTOTYPES -------------------- */
 
 /* Initialization */
-void init();
-void init_conf();
+void init(int argc, char **argv);
+void read_args(int argc, char **argv);
 void init_sharedmem();
-void init_semaphores();
 
 /* Lifetime */
 int createTransaction();
+int chooseNode(int exclude);
 void getBilancio();
-void addToPendingList(transaction tr);
-void printPendingList();
-void removeFromPendingList(transaction tr);
-void freePendingList();
 
 /* Signal Handlers */
 void sigusr1_handler();
@@ -30,41 +28,38 @@ void shutdown(int status);
 /* -------------------- GLOBAL VARIABLES -------------------- */
 
 /**** SHARED MEMORY IDs ****/
-int shmConfig;        /* ID shmem configuration */
-int shmNodes;         /* ID shmem nodes data */
-int shmUsers;         /* ID shmem users data */
-int shmLibroMastro;   /* ID shmem Libro Mastro */
-int shmBlockNumber;   /* ID shmem libro mastro block number */
+int shmArena;         /* ID shmem arena, all the shared data */
 
 /**** SHARED MEMORY ATTACHED VARIABLES ****/
+arena_header *arena;          /* Shmem arena, the regions follow */
 node *shmNodesArray;          /* Shmem Array of Node PIDs */
 user *shmUsersArray;          /* Shmem Array of User PIDs */
-block *libroMastroArray;      /* Shmem Array of blocks */
-unsigned int *block_number;   /* Shmem number of the last block */
+account *balancesArray;       /* Shmem Array of committed balances */
+shm_rwlock *locksArray;       /* Shmem Array of readers/writers locks */
+void *poolsArray;             /* Shmem transaction pools of the nodes */
+int *nodes_num;               /* Shmem number of nodes in the table */
 unsigned long *conf;          /* Shmem Array of configuration values */
 
-/**** MESSAGE QUEUE ID ****/
-int msgTrans;        /* Message queue to send transactions */
-
 /**** SEMAPHORE IDs ****/
-int semNodes;        /* Semaphore for shmem access on the Array of Node PIDs */
-int semUsers;        /* Semaphore for shmem access on the Array of User PIDs */
-int semLibroMastro;  /* Semaphore for shmem access on the Libro Mastro */
-int semBlockNumber;  /* Semaphore for the last block number */
 int semSimulation;   /* Semaphore for the simulation */
 
+/**** LOCKS ****/
+shm_rwlock *lockNodes; /* Lock for shmem access on the Array of Node PIDs */
+shm_rwlock *lockUsers; /* Lock for shmem access on the Array of User PIDs */
+
 /*** Global variables ***/
 int bilancio;        /* User's budget */
-struct pendingTr *pendingList; /* List of unprocessed transactions */
+int speso;           /* Quantities and rewards of the sent transactions */
 int my_index;        /* User's index in the shmUsersArray */
 int fails;           /* User's failed transaction attempts */
+transaction *burst;  /* Transactions sent with a single push */
 pid_t my_pid;
 
 int main(int argc, char **argv)
 {
     fails = 0;  /* used with SO_RETRY */
     
-    init();
+    init(argc, argv);
 
 #ifdef DEBUG
 	printf("[INFO] user.main(%d): Ready to create transactions...\n", my_pid);
@@ -92,42 +87,38 @@ int main(int argc, char **argv)
 /* -------------------- INITIALIZATION FUNCTIONS -------------------- */
 
 /* Accessing all the required IPC objects, setting the signal handlers */
-void init()
+void init(int argc, char **argv)
 {
-    int i = 0;
     struct sembuf s;
     s.sem_num = 0;
     s.sem_op = 0;
     s.sem_flg = 0;
     
     my_pid = getpid();
+    burst = NULL;
 
-	init_conf();
-	init_semaphores();
+	read_args(argc, argv);
 	init_sharedmem();
 
-    /* Initializes seed for the random number generation */ 
-    srand(my_pid+getppid());
+    /* The random numbers of the user's slot */ 
+    initRandom(conf[SO_SEED], USER_STREAM(my_index));
 
     /* Initializes the User's budget */
     bilancio = conf[SO_BUDGET_INIT];
+    speso = 0;
 
-    /* Create pending transactions list */
-    pendingList = NULL;
+    burst = (transaction *)malloc(conf[SO_TRANS_BURST] * sizeof(transaction));
+    if(burst == NULL){
+        MSG_ERR("user.init(): burst, error while allocating memory "
+                "for the transactions.");
+        perror("\tburst: ");
+        shutdown(EXIT_FAILURE);
+    }
 
 	/* Master wants to kill the node */
     set_handler(SIGUSR1, sigusr1_handler);
     set_handler(SIGINT,  sigint_handler);
 
-	block_signals(3, SIGINT, SIGTERM, SIGUSR1);
-    initReadFromShm(semUsers);
-    i = 0;
-    while(shmUsersArray[i].pid != my_pid)
-        i++;
-    my_index = i;
-    endReadFromShm(semUsers);
-	unblock_signals(3, SIGINT, SIGTERM, SIGUSR1);
-
 	/* Waiting that the other nodes are ready and active */
 	reserveSem(semSimulation, 0);
     if(semop(semSimulation, &s, 1) == -1){
@@ -138,183 +129,159 @@ void init()
     }
 }
 
-/* Accessing the configuration shared memory segment in READ ONLY */
-void init_conf()
+/* Reads the slot index and the IPC IDs given by the master */
+void read_args(int argc, char **argv)
 {
-    shmConfig = shmget( SHM_ENV_KEY, 
-						sizeof(unsigned long) * N_RUNTIME_CONF_VALUES, 
-						SHM_RDONLY);
-	if (shmConfig == -1){
-		MSG_ERR("user.init(): shmConfig, error while getting the shared memory segment.");
-        perror("\tshmConfig ");
-		shutdown(EXIT_FAILURE);
-	}
-    conf = shmat(shmConfig, NULL, 0);
-}
-
-/* Accessing the other shared memory segments and attaching */
-void init_sharedmem()
-{
-    shmUsers = shmget(SHM_USER_KEY, sizeof(user) * conf[SO_USERS_NUM], 0600);
-    if (shmUsers == -1)
-    {
-        MSG_ERR("user.init(): shmUsers, error while creating the shared memory segment.");
-        perror("\tshmUsers ");
-        shutdown(EXIT_FAILURE);
+    if(argc != N_SPAWN_ARGS){
+        MSG_ERR("user.init(): the user must be started by the master.");
+        exit(EXIT_FAILURE);
     }
-	shmUsersArray = (user *)shmat(shmUsers, NULL, 0);
-
-    shmNodes = shmget(SHM_NODE_KEY, sizeof(node) * conf[SO_NODES_NUM], 
-                      SHM_RDONLY);
-    if (shmNodes == -1)
-    {
-        MSG_ERR("user.init(): shmNodes, error while creating the shared memory segment.");
-        perror("\tshmNodes ");
-        shutdown(EXIT_FAILURE);
-    }
-	shmNodesArray = (node *)shmat(shmNodes, NULL, 0);
-
-    /* Accessing shmem segment for the libro mastro's block number */
-    shmBlockNumber = shmget(SHM_BLOCK_NUMBER, 
-                            sizeof(unsigned int), 
-                            SHM_RDONLY);
-    if (shmBlockNumber == -1){
-		MSG_ERR("user.init(): shmBlockNumber, error while creating the shared memory segment.");
-        perror("\tshmBlockNumber ");
-		shutdown(EXIT_FAILURE); 
-	}
-    block_number = (unsigned int *)shmat(shmBlockNumber, NULL, 0);
-
-    shmLibroMastro = shmget(SHM_LIBROMASTRO_KEY, 
-                            sizeof(block) * SO_REGISTRY_SIZE, 
-                            SHM_RDONLY);
-    if (shmLibroMastro == -1)
-    {
-        MSG_ERR("user.init(): shmLibroMastro, error while creating the shared memory segment.");
-        perror("\tsemLibroMastro ");
-        shutdown(EXIT_FAILURE);
-    }
-	libroMastroArray = (block *)shmat(shmLibroMastro, NULL, 0);
+    my_index = atoi(argv[ARG_INDEX]);
+    semSimulation = atoi(argv[ARG_SEM_SIMULATION]);
+    shmArena = atoi(argv[ARG_SHM_ARENA]);
 }
 
-/* Accessing to the semaphores for the shared memory */
-void init_semaphores()
+
+/* 
+ * Attaching the shmem arena, with SO_PREFAULT the regions used by the 
+ * user are mapped before the simulation starts
+ */
+void init_sharedmem()
 {
-    semUsers = semget(SEM_USER_KEY, 3, 0600);
-    if (semUsers == -1)
-    {
-        MSG_ERR("user.init(): semUsers, error while creating the semaphore.");
-        perror("\tsemUsers ");
-        shutdown(EXIT_FAILURE);
+    arena = (arena_header *)shmat(shmArena, NULL, 0);
+    if(arena == (void *) -1){
+        MSG_ERR("user.init(): shmArena, error while attaching the shared memory segment.");
+        perror("\tshmArena ");
+        exit(EXIT_FAILURE);
     }
-
-    semNodes = semget(SEM_NODE_KEY, 3, 0600);
-    if (semNodes == -1)
-    {
-        MSG_ERR("user.init(): semNodes, error while getting the semaphore.");
-        perror("\tsemNodes ");
-        shutdown(EXIT_FAILURE);
+    if(arenaCheck(arena) == -1){
+        MSG_ERR("user.init(): shmArena, the arena was made by another version of the master.");
+        exit(EXIT_FAILURE);
     }
 
-    semBlockNumber = semget(SEM_BLOCK_NUMBER, 3, 0600);
-	if(semBlockNumber == -1){
-		MSG_ERR("user.init(): semBlockNumber, error while getting the semaphore.");
-        perror("\tsemBlockNumber ");
-		shutdown(EXIT_FAILURE);
-	}
-
-    semLibroMastro = semget(SEM_LIBROMASTRO_KEY, 3, 0600);
-    if (semLibroMastro == -1)
-    {
-        MSG_ERR("user.init(): semLibroMastro, error while getting the semaphore.");
-        perror("\tsemLibroMastro ");
-        shutdown(EXIT_FAILURE);
+    conf = arenaRegion(arena, REGION_CONF);
+    shmUsersArray = arenaRegion(arena, REGION_USERS);
+    shmNodesArray = arenaRegion(arena, REGION_NODES);
+    balancesArray = arenaRegion(arena, REGION_BALANCES);
+    locksArray = arenaRegion(arena, REGION_LOCKS);
+    poolsArray = arenaRegion(arena, REGION_POOLS);
+    nodes_num = arenaRegion(arena, REGION_NODES_NUM);
+    lockNodes = &locksArray[LOCK_NODES];
+    lockUsers = &locksArray[LOCK_USERS];
+
+    if(conf[SO_PREFAULT]){
+        arenaPrefault(arena, REGION_CONF);
+        arenaPrefault(arena, REGION_USERS);
+        arenaPrefault(arena, REGION_BALANCES);
+        arenaPrefault(arena, REGION_POOLS);
+        arenaPrefault(arena, REGION_NODES_NUM);
     }
-
-    semSimulation = semget(SEM_SIM_KEY, 1, 0600);
-    if(semSimulation == -1){
-		MSG_ERR("user.init(): semSimulation, error while getting the semaphore.");
-        perror("\tsemSimulation ");
-		shutdown(EXIT_FAILURE);
-	}
 }
 
 /* -------------------- LIFETIME FUNCTIONS -------------------- */
 
-/* Creates a transaction and sends it to a node msgqueue */
+/* 
+ * Creates a burst of up to SO_TRANS_BURST transactions and sends them 
+ * to a node transaction pool with a single push
+ */
 int createTransaction()
 {
-    msgbuf msg;
+    int pushed;
     struct timespec timestamp;
     struct timespec tempo;
     int try_receiver_count = 0;
+    int n = 0;             /* Transactions in the burst */
+    int available;         /* Budget not used by the burst */
 
-    transaction newTr;     /* new transaction */
+    user receiver;         /* Snapshot of the receiver's slot */
     int randomReceiverId;  /* Random user */
     int randomReceiverPID; /* Random user */
-    int randomNodeId;      /* Random node */
-    int randomNodePID;     /* Random node */
+    int nodeId;            /* Chosen node */
+    int redirects = 0;     /* Nodes tried after the first one */
     int randomQuantity;    /* Random quantity for the transaction */
     int nodeReward;        /* Transaction reward */
 
-    try_receiver_count = 0;
-    /* genera transazione */
-    /* 
-     * Random receiver, checks if it's alive. Can try max 5 times
-     * if the user cannot find an alive receiver after 5 tries, it
-     * counts as a transaction failure. 
-     */
 	block_signals(3, SIGINT, SIGTERM, SIGUSR1);
-    initReadFromShm(semUsers);
-    do{
-        randomReceiverId = randomNum(0, conf[SO_USERS_NUM] - 1);
-        randomReceiverPID = shmUsersArray[randomReceiverId].pid;
-        try_receiver_count ++;
-    }
-    while(randomReceiverPID == my_pid 
-          && !shmUsersArray[randomReceiverId].alive 
-          && try_receiver_count < 6);
-    endReadFromShm(semUsers);
+    available = bilancio;
+    while(n < conf[SO_TRANS_BURST] && available >= 2){
+        try_receiver_count = 0;
+        /* genera transazione */
+        /* 
+         * Random receiver, checks if it's alive. Can try max 5 times
+         * if the user cannot find an alive receiver after 5 tries, it
+         * counts as a transaction failure. 
+         */
+        do{
+            randomReceiverId = randomNum(0, conf[SO_USERS_NUM] - 1);
+            seqReadCopy(&shmUsersArray[randomReceiverId].seq, &receiver, 
+                        &shmUsersArray[randomReceiverId], sizeof(user));
+            randomReceiverPID = receiver.pid;
+            try_receiver_count ++;
+        }
+        while(randomReceiverPID == my_pid 
+              && !receiver.alive 
+              && try_receiver_count < 6);
 
-    if(try_receiver_count == 6)
-        return 0;
+        if(try_receiver_count == 6)
+            break;
 
-    randomNodeId = randomNum(0, conf[SO_NODES_NUM] - 1);
-    randomQuantity = randomNum(2, bilancio);
+        randomQuantity = randomNum(2, available);
 
-    initReadFromShm(semNodes);
-    randomNodePID = shmNodesArray[randomNodeId].pid;
-    endReadFromShm(semNodes);
+        nodeReward = (int)(randomQuantity * conf[SO_REWARD] / 100);
+        if(nodeReward == 0)
+            nodeReward = 1;
 
-    msgTrans = msgget(ftok(FTOK_PATHNAME_NODE, randomNodePID), 0600);
+        randomQuantity -= nodeReward;
 
-    nodeReward = (int)(randomQuantity * conf[SO_REWARD] / 100);
-    if(nodeReward == 0)
-        nodeReward = 1;
+        clock_gettime(CLOCK_REALTIME, &timestamp);
+        burst[n].quantity = randomQuantity;
+        burst[n].receiver = randomReceiverPID;
+        burst[n].reward = nodeReward;
+        burst[n].sender = my_pid;
+        burst[n].timestamp = timestamp;
+
+        available -= randomQuantity + nodeReward;
+        n++;
+    }
 
-    randomQuantity -= nodeReward;
+    if(n == 0){
+        unblock_signals(3, SIGINT, SIGTERM, SIGUSR1);
+        return 0;
+    }
 
-    clock_gettime(CLOCK_REALTIME, &timestamp);
-    newTr.quantity = randomQuantity;
-    newTr.receiver = randomReceiverPID;
-    newTr.reward = nodeReward;
-    newTr.sender = my_pid;
-    newTr.timestamp = timestamp;
+    /* 
+     * a signal handler must not stop the push between reserve and publish.
+     * When the pool is full the same transactions go to another node 
+     * before counting a failure.
+     */
+    nodeId = chooseNode(-1);
+    pushed = tpPush(tpGet(poolsArray, nodeId, conf[SO_TP_SIZE]), 
+                    burst, n, NULL);
+    while(pushed < 0 && redirects < MAX_REDIRECTS 
+          && redirects < *nodes_num - 1){
+        nodeId = chooseNode(nodeId);
+        pushed = tpPush(tpGet(poolsArray, nodeId, conf[SO_TP_SIZE]), 
+                        burst, n, NULL);
+        redirects++;
+    }
 
-    msg.trans = newTr;
-    msg.mtype = 1;
+    if(redirects > 0 || pushed < 0){
+        seqWriteBegin(&shmUsersArray[my_index].seq);
+        shmUsersArray[my_index].redirects += redirects;
+        if(pushed < 0)
+            shmUsersArray[my_index].rejects++;
+        seqWriteEnd(&shmUsersArray[my_index].seq);
+    }
 	unblock_signals(3, SIGINT, SIGTERM, SIGUSR1);
 
-    if(msgsnd(msgTrans, &msg, sizeof(msgbuf), IPC_NOWAIT) < 0)
+    if(pushed < 0)
     {
 #ifdef DEBUG
         MSG_INFO2("user.createTransaction(): Node transaction pool is full!");
-        perror("\tuser.msgsnd(): ");
 #endif
         return 0;
     } else {
-        addToPendingList(newTr);
-        /* printPendingList(); */
+        speso += bilancio - available;
         tempo.tv_sec = 0;
         tempo.tv_nsec = randomNum(conf[SO_MIN_TRANS_GEN_NSEC], 
                                   conf[SO_MAX_TRANS_GEN_NSEC]);
@@ -323,111 +290,47 @@ int createTransaction()
     return 1;
 }
 
-/* Computes the budget by reading the blockchain and its pending trans. */
-void getBilancio()
+/* 
+ * Power of two choices: picks two random nodes and returns the one
+ * with less transactions waiting in the pool, the load spreads without 
+ * reading the occupancy of every node. The exclude node is never picked
+ * (-1 to pick any node).
+ */
+int chooseNode(int exclude)
 {
-    int i = 0, j = 0; 
-    struct pendingTr *head = pendingList;
+    int first;
+    int second;
+    int nodes = *nodes_num; /* Grows when the master spawns a node */
 
-    bilancio = conf[SO_BUDGET_INIT];
+    do{
+        first = randomNum(0, nodes - 1);
+    } while(first == exclude);
+    do{
+        second = randomNum(0, nodes - 1);
+    } while(second == exclude);
 
-	block_signals(3, SIGINT, SIGTERM, SIGUSR1);
-    initReadFromShm(semBlockNumber);
-    initReadFromShm(semLibroMastro);
-    for (i = 0; i < *block_number; i++)
-    {
-        for (j = 0; j < SO_BLOCK_SIZE; j++)
-        {   
-            if (libroMastroArray[i].transBlock[j].receiver == my_pid)
-                bilancio += libroMastroArray[i].transBlock[j].quantity;
-
-            if (libroMastroArray[i].transBlock[j].sender == my_pid){
-                bilancio -= (libroMastroArray[i].transBlock[j].quantity
-                            + libroMastroArray[i].transBlock[j].reward);
-                removeFromPendingList(libroMastroArray[i].transBlock[j]);
-            }
-        }
-    }
-    endReadFromShm(semLibroMastro);
-    endReadFromShm(semBlockNumber);
-	unblock_signals(3, SIGINT, SIGTERM, SIGUSR1);
+    if(tpCount(tpGet(poolsArray, second, conf[SO_TP_SIZE])) 
+       < tpCount(tpGet(poolsArray, first, conf[SO_TP_SIZE])))
+        return second;
+    return first;
+}
 
-    head = pendingList;
-    while(head != NULL){
-        bilancio -= (head->trans.quantity + head->trans.reward);
-        head = head->next;
-    }
+/* 
+ * Computes the budget from the committed balance written by the nodes.
+ * The pending transactions are the sent ones not yet in the Libro Mastro,
+ * so bilancio = SO_BUDGET_INIT + credits - debits - (speso - debits).
+ */
+void getBilancio()
+{
+    bilancio = conf[SO_BUDGET_INIT] + balancesArray[my_index].credits - speso;
 
     block_signals(3, SIGINT, SIGTERM, SIGUSR1);
-    initWriteInShm(semUsers);
+    seqWriteBegin(&shmUsersArray[my_index].seq);
     shmUsersArray[my_index].budget = bilancio;
-    endWriteInShm(semUsers);
+    seqWriteEnd(&shmUsersArray[my_index].seq);
     unblock_signals(3, SIGINT, SIGTERM, SIGUSR1);
 }
 
-/* Add transaction to head */
-void addToPendingList(transaction tr)
-{
-    struct pendingTr *newEl = malloc(sizeof(struct pendingTr));
-    newEl->trans = tr;
-    newEl->next = pendingList;
-    pendingList = newEl;
-}
-
-/* Print pending list for debugging purposes */
-void printPendingList()
-{
-    struct pendingTr *head = pendingList;
-    printf("\n\n");
-    while(head != NULL){
-        printf("%d:%d => ", head->trans.sender, head->trans.quantity);
-        head = head->next;
-    }
-    printf("\n\n");
-}
-
-/* Remove transaction from pending list */
-void removeFromPendingList(transaction tr)
-{
-    struct pendingTr *head = pendingList;
-    struct pendingTr *prev = NULL;
-    int found = 0;
-
-    struct pendingTr *deleted = NULL;
-
-    while(head != NULL && !found){
-        if(head->trans.timestamp.tv_sec == tr.timestamp.tv_sec
-          && head->trans.timestamp.tv_nsec == tr.timestamp.tv_nsec 
-          && head->trans.sender == tr.sender
-          && head->trans.receiver == tr.receiver
-          && head->trans.quantity == tr.quantity
-          && head->trans.reward == tr.reward){
-            if(prev != NULL){
-                prev->next = head->next;
-            } else {
-                pendingList = head->next;
-            }
-            deleted = head;
-            found = 1;
-        } else {
-            prev = head;
-            head = head->next;
-        }
-    }
-
-    if(found)
-        free(deleted);
-}
-
-/* Free pending transactions list  */
-void freePendingList()
-{
-    if(pendingList != NULL){
-        freePendingList(pendingList->next);
-        free(pendingList);
-    }
-}
-
 /* -------------------- SIGNAL HANDLERS -------------------- */
 
 /* Used to create a transaction with a signal event */
@@ -459,46 +362,22 @@ void shutdown(int status)
     int i = 0;
     
     /* Setting the flag alive to zero */
-    initWriteInShm(semUsers);
+    seqWriteBegin(&shmUsersArray[my_index].seq);
     shmUsersArray[my_index].alive = 0;
-    endWriteInShm(semUsers);
-
-    /* Rimozione IPC */
-    /* detach the shmem for the Users array */
-    if(shmdt((void *)shmUsersArray) == -1){
-        MSG_ERR("user.shutdown(): shmUsersArray, error while detaching "
-                "the shmUsersArray shmem segment.");
-	}
-
-    /* detach the shmem for the Nodes array */
-    if(shmdt((void *)shmNodesArray) == -1){
-        MSG_ERR("user.shutdown(): shmNodesArray, error while detaching "
-                "the shmNodesArray shmem segment.");
-	}
+    seqWriteEnd(&shmUsersArray[my_index].seq);
 
-	/* detach the shmem for the libro mastro */
-    if(shmdt((void *)libroMastroArray) == -1){
-        MSG_ERR("user.shutdown(): libroMastroArray, error while detaching "
-                "the libroMastroArray shmem segment.");
-	}
-
-    /* detach the shmem for the last block number */
-    if(shmdt((void *)block_number) == -1){
-        MSG_ERR("user.shutdown(): block_number, error while detaching "
-                "the block_number shmem segment.");
+    /* detach the shmem arena */
+    if(shmdt((void *)arena) == -1){
+        MSG_ERR("user.shutdown(): arena, error while detaching "
+                "the arena shmem segment.");
 	}
+    /* 
+     * The arena is not marked for removal here: a user can end 
+     * before the nodes spawned at runtime attach it, the master 
+     * removes it at the end
+     */
 
-	/* detach the shmem for the configuration */
-    if(shmdt((void *)conf) == -1){
-        MSG_ERR("user.shutdown(): conf, error while detaching "
-                "the conf shmem segment.");
-	}
-    shmctl(shmUsers, IPC_RMID, NULL);
-    shmctl(shmNodes, IPC_RMID, NULL);
-    shmctl(shmLibroMastro, IPC_RMID, NULL);
-    shmctl(shmConfig, IPC_RMID, NULL);
-    shmctl(shmBlockNumber, IPC_RMID, NULL);
+    free(burst);
 
-    freePendingList(pendingList);
     exit(status);
 }